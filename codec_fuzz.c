@@ -0,0 +1,64 @@
+// libFuzzer entry point for the stream codecs.  Build with "redo
+// codec_fuzz.elf", which needs clang.
+//
+// The input is interpreted as a codec selector, a chunking seed and a
+// list of frames, each prefixed with a 2-byte size.  Frames go
+// through the differential round trip from codec_test.h, so any
+// encoder or decoder mismatch aborts.
+//
+// If the selector's top bit is set, the rest of the input is instead
+// fed as raw stream data to one of the decoders that resynchronize on
+// bad input.  These must never exit or overflow, and frames that pass
+// the CRC-32C check need to be plausible.
+
+#include "codec_test.h"
+
+static void raw_sink(void *ctx, const uint8_t *buf, ssize_t len) {
+    CHECK(len > 0 && len <= PACKET_MAX_SIZE);
+}
+
+static void raw_decode(const uint8_t *data, size_t size) {
+    static struct port *(*open[])(void) = { slip_open, slip_crc_open, packet2_crc_open };
+    struct port *port;
+    CHECK(port = open[data[0] % 3]());
+    uint64_t seed = data[1] + 1;
+    data += 2; size -= 2;
+    while (size) {
+        ssize_t chunk = 1 + prng_next(&seed) % 256;
+        if (chunk > size) chunk = size;
+        ssize_t n = codec_feed(port, data, chunk, raw_sink, NULL);
+        CHECK(n > 0);
+        data += n; size -= n;
+    }
+    free(port);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size < 4) return 0;
+    if (data[0] & 0x80) {
+        raw_decode(data, size);
+        return 0;
+    }
+    const struct codec *c = &codecs[data[0] % NB_CODECS];
+    uint64_t seed = data[1] + 1;
+    ssize_t max_chunk = 1 + data[2] * 64;
+    data += 3; size -= 3;
+
+    /* Payloads are referenced in place, sizes are clipped to what the
+     * codec can carry and to the remaining input. */
+    uint8_t payload[size];
+    ssize_t frame_size[size/3 + 1];
+    ssize_t total = 0;
+    int nb = 0;
+    while (size >= 3) {
+        ssize_t n = ((data[0] << 8) | data[1]) % c->max_frame + 1;
+        data += 2; size -= 2;
+        if (n > size) n = size;
+        memcpy(&payload[total], data, n);
+        frame_size[nb++] = n;
+        total += n;
+        data += n; size -= n;
+    }
+    if (nb) codec_roundtrip(c, payload, frame_size, nb, seed, max_chunk);
+    return 0;
+}
@@ -0,0 +1,271 @@
+#ifndef CODEC_TEST_H
+#define CODEC_TEST_H
+
+// Differential test support for the stream codecs, shared between
+// the randomized test/benchmark program (codec_test_main.c) and the
+// libFuzzer entry point (codec_fuzz.c).
+//
+// The idea: encode a list of frames with the packet_bridge encoder
+// and with a dumb reference encoder, check they agree, then feed the
+// encoded stream to the packet_bridge decoder in arbitrary chunks and
+// check that the original frames come out.
+
+#include "packet_bridge.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+// Failures abort() so the fuzzer sees them as crashes.
+#define CHECK(c) ({ \
+            if(!(c)) { \
+                fprintf(stderr, "%s: %d: CHECK FAIL: " #c "\n", __FILE__, __LINE__); \
+                abort(); \
+            } })
+
+
+/***** Reference codecs */
+
+/* These are written for clarity only.  Do not optimize. */
+
+static inline ssize_t ref_slip_encode(uint8_t *out, const uint8_t *in, ssize_t len) {
+    ssize_t n = 0;
+    out[n++] = 0xC0;
+    for (ssize_t i=0; i<len; i++) {
+        switch(in[i]) {
+        case 0xC0: out[n++] = 0xDB; out[n++] = 0xDC; break;
+        case 0xDB: out[n++] = 0xDB; out[n++] = 0xDD; break;
+        default:   out[n++] = in[i]; break;
+        }
+    }
+    out[n++] = 0xC0;
+    return n;
+}
+static inline ssize_t ref_hex_encode(uint8_t *out, const uint8_t *in, ssize_t len) {
+    ssize_t n = 0;
+    for (ssize_t i=0; i<len; i++) {
+        char tmp[4];
+        snprintf(tmp, sizeof(tmp), " %02x", in[i]);
+        memcpy(&out[n], tmp, 3);
+        n += 3;
+    }
+    out[n++] = '\n';
+    return n;
+}
+static inline uint32_t ref_crc32c(const uint8_t *in, ssize_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (ssize_t i=0; i<len; i++) {
+        crc ^= in[i];
+        for (int k=0; k<8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+/* Payload with CRC-32C trailer, little endian. */
+static inline ssize_t ref_crc_append(uint8_t *out, const uint8_t *in, ssize_t len) {
+    uint32_t crc = ref_crc32c(in, len);
+    memcpy(out, in, len);
+    for (int i=0; i<4; i++) out[len+i] = crc >> (8*i);
+    return len + 4;
+}
+static inline ssize_t ref_slip_encode_crc(uint8_t *out, const uint8_t *in, ssize_t len) {
+    uint8_t tmp[len + 4];
+    return ref_slip_encode(out, tmp, ref_crc_append(tmp, in, len));
+}
+static inline ssize_t ref_packetn_encode(uint32_t len_bytes, uint8_t *out, const uint8_t *in, ssize_t len) {
+    for (uint32_t i=0; i<len_bytes; i++) {
+        out[i] = (len >> (8 * (len_bytes - 1 - i))) & 0xFF;
+    }
+    memcpy(&out[len_bytes], in, len);
+    return len_bytes + len;
+}
+
+
+/***** Codec table */
+
+static inline struct port *port_crc(struct port *p) {
+    ((struct buf_port *)p)->flags |= BUF_PORT_CRC32C;
+    return p;
+}
+static inline struct port *slip_open(void) { return port_open_slip_stream(-1, -1); }
+static inline struct port *slip_crc_open(void) { return port_crc(slip_open()); }
+
+/* Encoders as used by the ports.  {packet,N} is only exposed as the
+ * port's encode method, so call that on a port kept for the purpose. */
+#define PORT_ENCODER(name, open) \
+    static inline ssize_t name(uint8_t *o, const uint8_t *i, ssize_t l) { \
+        static struct port *p; \
+        if (!p) p = open(); \
+        return p->encode(p, o, i, l); }
+#define PACKETN_CODEC(n) \
+    static inline struct port *packet##n##_open(void) { \
+        return port_open_packetn_stream(n, -1, -1); } \
+    PORT_ENCODER(packet##n##_encode, packet##n##_open) \
+    static inline ssize_t ref_packet##n##_encode(uint8_t *o, const uint8_t *i, ssize_t l) { \
+        return ref_packetn_encode(n, o, i, l); }
+PACKETN_CODEC(1)
+PACKETN_CODEC(2)
+PACKETN_CODEC(4)
+static inline struct port *packet2_crc_open(void) { return port_crc(packet2_open()); }
+PORT_ENCODER(packet2_encode_crc, packet2_crc_open)
+static inline ssize_t ref_packet2_encode_crc(uint8_t *o, const uint8_t *i, ssize_t l) {
+    uint8_t tmp[l + 4];
+    return ref_packetn_encode(2, o, tmp, ref_crc_append(tmp, i, l));
+}
+
+/* Write-side ports for testing packet_fanout(). */
+static inline struct port *slip_fd_open(int fd) { return port_open_slip_stream(-1, fd); }
+static inline struct port *slip_crc_fd_open(int fd) { return port_crc(slip_fd_open(fd)); }
+static inline struct port *packet2_fd_open(int fd) { return port_open_packetn_stream(2, -1, fd); }
+static inline struct port *packet2_crc_fd_open(int fd) { return port_crc(packet2_fd_open(fd)); }
+static inline struct port *hex_fd_open(int fd) { return port_open_hex_stream(-1, fd); }
+static inline struct port *hex_open(void)  { return port_open_hex_stream(-1, -1); }
+
+typedef ssize_t (*encode_fn)(uint8_t *out, const uint8_t *in, ssize_t len);
+struct codec {
+    const char *name;
+    struct port *(*open)(void);
+    encode_fn encode;
+    encode_fn ref_encode;
+    ssize_t max_encode;  // worst case encoded size, per payload byte
+    ssize_t max_frame;   // largest frame the decoder buffer can hold
+};
+static const struct codec codecs[] = {
+    { "slip",    slip_open,    slip_encode,    ref_slip_encode,    2, PACKET_MAX_SIZE - 1 },
+    { "hex",     hex_open,     hex_encode,     ref_hex_encode,     3, (2*PACKET_MAX_SIZE - 1) / 3 },
+    { "packet1", packet1_open, packet1_encode, ref_packet1_encode, 1, 255 },
+    { "packet2", packet2_open, packet2_encode, ref_packet2_encode, 1, PACKET_MAX_SIZE },
+    { "packet4", packet4_open, packet4_encode, ref_packet4_encode, 1, PACKET_MAX_SIZE },
+    { "slip+crc",    slip_crc_open,    slip_encode_crc,    ref_slip_encode_crc,    2, PACKET_MAX_SIZE - 5 },
+    { "packet2+crc", packet2_crc_open, packet2_encode_crc, ref_packet2_encode_crc, 1, PACKET_MAX_SIZE },
+};
+#define NB_CODECS (sizeof(codecs)/sizeof(codecs[0]))
+#define CODEC_ENCODE_MAX(c, len) ((c)->max_encode * ((len) + 4) + 4)
+
+
+/***** Test data and timing */
+
+/* Simple deterministic PRNG so failures can be reproduced from a seed. */
+static inline uint32_t prng_next(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s >> 32;
+}
+
+/* Payload bytes are biased towards values that are special to one of
+ * the codecs, so escaping is exercised. */
+static inline void fill_payload(uint64_t *s, uint8_t *buf, ssize_t len) {
+    static const uint8_t special[] = { 0xC0, 0xDB, 0xDC, 0xDD, '\n', ' ', 0x00, 0xFF };
+    for (ssize_t i=0; i<len; i++) {
+        uint32_t r = prng_next(s);
+        buf[i] = (r & 0x700) ? r : special[r % sizeof(special)];
+    }
+}
+
+#define BENCH_NS 200000000LL  // per measurement
+
+static inline int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void report(const char *codec, const char *op, const char *mix,
+                          int64_t ns, int64_t frames, int64_t bytes) {
+    fprintf(stderr, "%-11s %-4s %-8s %9.1f ns/frame %7.3f GB/s\n",
+            codec, op, mix, (double)ns / frames, (double)bytes / ns);
+}
+
+static volatile uint8_t bench_sink;
+
+
+/***** Chunked decoding */
+
+/* Feed a chunk of encoded stream into a buffered port the same way
+ * pop_read() does, then pop all frames that are complete.  Each frame
+ * is passed to the sink.  Returns the number of bytes consumed from
+ * the chunk, which can be less than len when the port buffer is full. */
+typedef void (*frame_sink_fn)(void *ctx, const uint8_t *buf, ssize_t len);
+static inline ssize_t codec_feed(struct port *port, const uint8_t *in, ssize_t len,
+                                 frame_sink_fn sink, void *ctx) {
+    struct buf_port *p = (void*)port;
+    uint32_t room;
+    uint8_t *tail = buf_port_reserve(p, &room);
+    ssize_t n = len < room ? len : room;
+    memcpy(tail, in, n);
+    p->count += n;
+    uint8_t out[PACKET_MAX_SIZE];
+    ssize_t rlen;
+    while ((rlen = port->pop(p, out, sizeof(out)))) {
+        sink(ctx, out, rlen);
+    }
+    return n;
+}
+
+/* Check that a stream of frames survives encoding and chunked
+ * decoding.  Frames are concatenated in payload, with sizes in size[].
+ * Chunk sizes are drawn from the PRNG, in the range 1..max_chunk. */
+struct roundtrip {
+    const uint8_t *payload;
+    const ssize_t *size;
+    int nb_frames;
+    int frame;       // next expected frame
+    ssize_t offset;  // offset of next expected frame in payload
+};
+static inline void roundtrip_sink(void *ctx, const uint8_t *buf, ssize_t len) {
+    struct roundtrip *r = ctx;
+    CHECK(r->frame < r->nb_frames);
+    CHECK(len == r->size[r->frame]);
+    CHECK(!memcmp(buf, &r->payload[r->offset], len));
+    r->offset += len;
+    r->frame++;
+}
+static inline void codec_roundtrip(const struct codec *c,
+                                   const uint8_t *payload, const ssize_t *size, int nb_frames,
+                                   uint64_t seed, ssize_t max_chunk) {
+    ssize_t total = 0;
+    for (int i=0; i<nb_frames; i++) {
+        CHECK(size[i] > 0 && size[i] <= c->max_frame);
+        total += CODEC_ENCODE_MAX(c, size[i]);
+    }
+    uint8_t *enc, *ref;
+    CHECK(enc = malloc(total + 1));
+    CHECK(ref = malloc(total + 1));
+
+    /* Encoders need to agree byte for byte. */
+    ssize_t enc_len = 0, ref_len = 0, offset = 0;
+    for (int i=0; i<nb_frames; i++) {
+        ssize_t e = c->encode(&enc[enc_len], &payload[offset], size[i]);
+        ssize_t r = c->ref_encode(&ref[ref_len], &payload[offset], size[i]);
+        CHECK(e == r);
+        CHECK(!memcmp(&enc[enc_len], &ref[ref_len], e));
+        enc_len += e;
+        ref_len += r;
+        offset += size[i];
+    }
+
+    /* Decode in arbitrary chunks. */
+    struct port *port;
+    CHECK(port = c->open());
+    struct roundtrip r = { .payload = payload, .size = size, .nb_frames = nb_frames };
+    ssize_t in = 0;
+    while (in < enc_len) {
+        ssize_t chunk = 1 + prng_next(&seed) % max_chunk;
+        if (chunk > enc_len - in) chunk = enc_len - in;
+        ssize_t n = codec_feed(port, &enc[in], chunk, roundtrip_sink, &r);
+        CHECK(n > 0);
+        in += n;
+    }
+    CHECK(r.frame == nb_frames);
+    CHECK(((struct buf_port *)port)->head == ((struct buf_port *)port)->count);
+
+    free(port);
+    free(enc);
+    free(ref);
+}
+
+#endif
@@ -0,0 +1,315 @@
+// Stream codec test and benchmark.
+//
+//   codec_test.elf test [iterations] [seed]
+//   codec_test.elf bench
+//
+// The test mode runs randomized differential round trips through all
+// codecs, see codec_test.h.  The bench mode measures each encoder and
+// decoder in isolation, without any I/O, over a couple of frame size
+// mixes.  Ports and the packet loop are tested in port_test_main.c.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "codec_test.h"
+#include "macros.h"
+
+#include <time.h>
+
+
+/***** Frame size mixes */
+
+struct mix {
+    const char *name;
+    ssize_t (*size)(uint64_t *s, ssize_t max);
+};
+static ssize_t clip(ssize_t size, ssize_t max) { return size > max ? max : size; }
+static ssize_t mix_small(uint64_t *s, ssize_t max) { return clip(64, max); }
+static ssize_t mix_mtu(uint64_t *s, ssize_t max)   { return clip(1500, max); }
+static ssize_t mix_large(uint64_t *s, ssize_t max) { return max; }
+static ssize_t mix_imix(uint64_t *s, ssize_t max) {
+    /* Simple IMIX: 7 x 64, 4 x 576, 1 x 1500 */
+    uint32_t r = prng_next(s) % 12;
+    return clip(r < 7 ? 64 : r < 11 ? 576 : 1500, max);
+}
+static ssize_t mix_uniform(uint64_t *s, ssize_t max) { return 1 + prng_next(s) % max; }
+static ssize_t mix_tiny(uint64_t *s, ssize_t max) { return 1 + prng_next(s) % 4; }
+static const struct mix mixes[] = {
+    { "64",      mix_small },
+    { "imix",    mix_imix },
+    { "1500",    mix_mtu },
+    { "max",     mix_large },
+    { "uniform", mix_uniform },
+    { "tiny",    mix_tiny },
+};
+#define NB_MIXES (sizeof(mixes)/sizeof(mixes[0]))
+
+/* Generate nb frames from a mix, returning total payload size. */
+static ssize_t make_frames(uint64_t *s, const struct codec *c, const struct mix *m,
+                           uint8_t *payload, ssize_t *size, int nb) {
+    ssize_t total = 0;
+    for (int i=0; i<nb; i++) {
+        size[i] = m->size(s, c->max_frame);
+        fill_payload(s, &payload[total], size[i]);
+        total += size[i];
+    }
+    return total;
+}
+
+
+/***** Test */
+
+#define TEST_FRAMES 64
+
+static void test_crc32c(uint64_t seed) {
+    const uint8_t check[] = "123456789";
+    CHECK(0xE3069283 == crc32c(0, check, 9));
+    CHECK(0xE3069283 == crc32c_sw(0, check, 9));
+    CHECK(0xE3069283 == ref_crc32c(check, 9));
+
+    /* All alignments and tail lengths, and incremental use. */
+    uint8_t buf[256];
+    fill_payload(&seed, buf, sizeof(buf));
+    for (int offset=0; offset<8; offset++) {
+        for (int len=0; len<sizeof(buf)-offset; len++) {
+            uint32_t ref = ref_crc32c(&buf[offset], len);
+            CHECK(ref == crc32c(0, &buf[offset], len));
+            CHECK(ref == crc32c_sw(0, &buf[offset], len));
+            int half = len / 2;
+            CHECK(ref == crc32c(crc32c(0, &buf[offset], half), &buf[offset+half], len-half));
+        }
+    }
+}
+
+/* Corrupt one byte inside a frame and check that the decoder drops
+ * it and picks up again.  Output must be the original frames in order
+ * with some missing.  For SLIP the damage is limited to the one frame,
+ * unless the corruption hits a delimiter. */
+struct resync {
+    const uint8_t *payload;
+    const ssize_t *size;
+    int nb_frames;
+    int frame;
+    ssize_t offset;
+    int delivered;
+};
+static void resync_sink(void *ctx, const uint8_t *buf, ssize_t len) {
+    struct resync *r = ctx;
+    for (; r->frame < r->nb_frames; r->offset += r->size[r->frame++]) {
+        if (len == r->size[r->frame] && !memcmp(buf, &r->payload[r->offset], len)) break;
+    }
+    CHECK(r->frame < r->nb_frames);
+    r->offset += r->size[r->frame++];
+    r->delivered++;
+}
+static void test_resync(const struct codec *c, uint64_t *s,
+                        const uint8_t *payload, const ssize_t *size, int nb) {
+    static uint8_t enc[TEST_FRAMES * 3 * PACKET_MAX_SIZE];
+    ssize_t enc_len = 0, offset = 0, bad_start = 0, bad_end = 0;
+    int bad = prng_next(s) % nb;
+    for (int i=0; i<nb; i++) {
+        if (i == bad) bad_start = enc_len;
+        enc_len += c->encode(&enc[enc_len], &payload[offset], size[i]);
+        if (i == bad) bad_end = enc_len;
+        offset += size[i];
+    }
+    ssize_t pos = bad_start + 1 + prng_next(s) % (bad_end - bad_start - 2);
+    uint8_t orig = enc[pos];
+    enc[pos] ^= 1 + prng_next(s) % 255;
+    int delimiter = (orig == 0xC0 || enc[pos] == 0xC0);
+
+    struct port *port;
+    CHECK(port = c->open());
+    struct resync r = { .payload = payload, .size = size, .nb_frames = nb };
+    for (ssize_t in = 0; in < enc_len; ) {
+        ssize_t chunk = 1 + prng_next(s) % 1024;
+        if (chunk > enc_len - in) chunk = enc_len - in;
+        in += codec_feed(port, &enc[in], chunk, resync_sink, &r);
+    }
+    CHECK(r.delivered < nb);
+    if (!strncmp(c->name, "slip", 4) && !delimiter) CHECK(r.delivered == nb - 1);
+    free(port);
+}
+
+/* SLIP cases the encoder doesn't produce: frames with only a trailing
+ * delimiter (RFC 1055), and noise without any delimiter. */
+struct collect {
+    int nb;
+    uint8_t first[4];
+};
+static void collect_sink(void *ctx, const uint8_t *buf, ssize_t len) {
+    struct collect *c = ctx;
+    if (c->nb < sizeof(c->first)) c->first[c->nb] = buf[0];
+    c->nb++;
+}
+static void test_slip_drop(uint64_t seed) {
+    /* Bad escape in the first chunk, good frames in the second. */
+    const uint8_t chunk1[] = { 0xAA, 0xDB, 0x01 };
+    const uint8_t chunk2[] = { 0xAA, 0xC0, 0xBB, 0xC0, 0xCC, 0xC0 };
+    struct port *port = slip_open();
+    struct collect c = {};
+    CHECK(sizeof(chunk1) == codec_feed(port, chunk1, sizeof(chunk1), collect_sink, &c));
+    CHECK(sizeof(chunk2) == codec_feed(port, chunk2, sizeof(chunk2), collect_sink, &c));
+    CHECK(c.nb == 2 && c.first[0] == 0xBB && c.first[1] == 0xCC);
+    free(port);
+
+    /* A checked frame with an empty payload is skipped, and doesn't
+     * hide the frame behind it in the same chunk. */
+    uint8_t enc[32], pl[3] = { 0xDD, 0xDD, 0xDD };
+    ssize_t n = slip_encode_crc(enc, pl, 0);
+    n += slip_encode_crc(&enc[n], pl, sizeof(pl));
+    port = slip_crc_open();
+    c = (struct collect){};
+    CHECK(n == codec_feed(port, enc, n, collect_sink, &c));
+    CHECK(c.nb == 1 && c.first[0] == 0xDD);
+    free(port);
+
+    /* Noise, many times the buffer size.  Escapes are valid, so this
+     * also covers frames that are too large. */
+    struct port *(*open[])(void) = { slip_open, slip_crc_open };
+    for (int i=0; i<2; i++) {
+        port = open[i]();
+        struct collect c = {};
+        uint8_t noise[1000];
+        for (int k=0; k<100; k++) {
+            for (int j=0; j<sizeof(noise); j++) {
+                noise[j] = prng_next(&seed);
+                if (noise[j] == 0xC0) noise[j] = 0xDB;
+                if (j && noise[j-1] == 0xDB) noise[j] = 0xDC;
+            }
+            for (int j=0; j<sizeof(noise); ) {
+                ssize_t n = codec_feed(port, &noise[j], sizeof(noise) - j, collect_sink, &c);
+                CHECK(n > 0);
+                j += n;
+            }
+        }
+        /* Terminate the noise, then a good frame. */
+        uint8_t frame[16] = { 0xC0 }, payload[1] = { 0x55 };
+        ssize_t len = 1 + (i ? slip_encode_crc(&frame[1], payload, 1) : slip_encode(&frame[1], payload, 1));
+        CHECK(len == codec_feed(port, frame, len, collect_sink, &c));
+        CHECK(c.nb == 1 && c.first[0] == 0x55);
+        free(port);
+    }
+}
+
+static int test(int iterations, uint64_t seed) {
+    test_crc32c(seed);
+    test_slip_drop(seed);
+    static uint8_t payload[TEST_FRAMES * PACKET_MAX_SIZE];
+    ssize_t size[TEST_FRAMES];
+    /* Chunk sizes: single bytes as on a slow TTY, up to multiple
+     * frames per read. */
+    static const ssize_t max_chunk[] = { 1, 3, 64, 4096, 3 * PACKET_MAX_SIZE };
+    for (int it=0; it<iterations; it++) {
+        for (int ci=0; ci<NB_CODECS; ci++) {
+            for (int mi=0; mi<NB_MIXES; mi++) {
+                const struct codec *c = &codecs[ci];
+                uint64_t s = seed;
+                int nb = 1 + prng_next(&s) % TEST_FRAMES;
+                make_frames(&s, c, &mixes[mi], payload, size, nb);
+                for (int k=0; k<sizeof(max_chunk)/sizeof(max_chunk[0]); k++) {
+                    codec_roundtrip(c, payload, size, nb, s + k, max_chunk[k]);
+                }
+                if (strchr(c->name, '+')) {
+                    test_resync(c, &s, payload, size, nb);
+                }
+            }
+        }
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    LOG("codec_test: %d iterations OK\n", iterations);
+    return 0;
+}
+
+
+/***** Benchmark */
+
+#define BENCH_FRAMES 1024
+
+static void count_sink(void *ctx, const uint8_t *buf, ssize_t len) {
+    (*(int64_t*)ctx)++;
+}
+
+static void bench_codec(const struct codec *c, const struct mix *m) {
+    static uint8_t payload[BENCH_FRAMES * PACKET_MAX_SIZE];
+    static uint8_t enc[BENCH_FRAMES * 3 * PACKET_MAX_SIZE];
+    ssize_t size[BENCH_FRAMES];
+    uint64_t s = 1;
+    ssize_t total = make_frames(&s, c, m, payload, size, BENCH_FRAMES);
+    if (!total) return;
+
+    /* Encode.  Note that for {packet,N} this includes a payload copy
+     * to build the stream, which the write path does not do. */
+    int64_t frames = 0, bytes = 0, t0 = now_ns(), t1;
+    ssize_t enc_len = 0;
+    do {
+        ssize_t offset = 0;
+        enc_len = 0;
+        for (int i=0; i<BENCH_FRAMES; i++) {
+            uint8_t *out = &enc[enc_len];
+            enc_len += c->encode(out, &payload[offset], size[i]);
+            bench_sink = *out;
+            offset += size[i];
+        }
+        frames += BENCH_FRAMES;
+        bytes += total;
+    } while ((t1 = now_ns()) - t0 < BENCH_NS);
+    report(c->name, "enc", m->name, t1 - t0, frames, bytes);
+
+    /* Decode, in read()-sized chunks. */
+    struct port *port;
+    ASSERT(port = c->open());
+    frames = 0; bytes = 0; t0 = now_ns();
+    int64_t popped = 0;
+    do {
+        ssize_t in = 0;
+        while (in < enc_len) {
+            ssize_t chunk = enc_len - in < 4096 ? enc_len - in : 4096;
+            in += codec_feed(port, &enc[in], chunk, count_sink, &popped);
+        }
+        frames += BENCH_FRAMES;
+        bytes += total;
+    } while ((t1 = now_ns()) - t0 < BENCH_NS);
+    ASSERT(popped == frames);
+    report(c->name, "dec", m->name, t1 - t0, frames, bytes);
+    free(port);
+}
+
+static void bench_crc32c(void) {
+    static uint8_t buf[1 << 16];
+    uint64_t s = 1;
+    fill_payload(&s, buf, sizeof(buf));
+    uint32_t (*fn[])(uint32_t, const uint8_t *, size_t) = { crc32c, crc32c_sw };
+    const char *name[] = { "crc32c", "crc32c_sw" };
+    for (int i=0; i<2; i++) {
+        int64_t bytes = 0, t0 = now_ns(), t1;
+        do {
+            bench_sink = fn[i](0, buf, sizeof(buf));
+            bytes += sizeof(buf);
+        } while ((t1 = now_ns()) - t0 < BENCH_NS);
+        report(name[i], "", "64k", t1 - t0, bytes / sizeof(buf), bytes);
+    }
+}
+
+static int bench(void) {
+    bench_crc32c();
+    for (int ci=0; ci<NB_CODECS; ci++) {
+        for (int mi=0; mi<NB_MIXES; mi++) {
+            bench_codec(&codecs[ci], &mixes[mi]);
+        }
+    }
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    const char *cmd = argc > 1 ? argv[1] : "test";
+    if (!strcmp(cmd, "test")) {
+        int iterations = argc > 2 ? atoi(argv[2]) : 20;
+        uint64_t seed  = argc > 3 ? strtoull(argv[3], NULL, 0) : 0x123456789ULL;
+        return test(iterations, seed);
+    }
+    if (!strcmp(cmd, "bench")) {
+        return bench();
+    }
+    ERROR("usage: %s test [iterations] [seed] | bench\n", argv[0]);
+}
@@ -14,7 +14,7 @@
    access to whatever the tap interface is bridged to.
 */
 
-#define _POSIX_C_SOURCE 1
+#define _POSIX_C_SOURCE 200112L
 
 #include "packet_bridge.h"
 
@@ -40,8 +40,17 @@
 #include <arpa/inet.h>
 
 #include <poll.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <asm/socket.h> // SO_BINDTODEVICE
+
+#include <stddef.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 
 
 //#include "/usr/include/asm-generic/termbits.h"
@@ -49,6 +58,15 @@
 
 #include <asm-generic/termbits.h>
 #include <asm-generic/ioctls.h>
+#include <linux/serial.h>
+#include <time.h>
+#include <signal.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC32C 1
+#define HAVE_POPCNT 1
+#endif
 
 
 /***** 1. PACKET INTERFACES */
@@ -75,18 +93,260 @@ static void log_addr(struct sockaddr_in *sa) {
     LOG("%d\n", ntohs(sa->sin_port));
 }
 
+/* TTYs are opened non-blocking, so output can be refused when the
+ * driver buffer is full.  Wait for room in that case. */
+static int write_again(int fd, ssize_t rv) {
+    if (rv == -1 && errno == EAGAIN) {
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        ASSERT_ERRNO(poll(&pfd, 1, -1));
+        return 1;
+    }
+    return 0;
+}
+
 static void assert_write(int fd, uint8_t *buf, uint32_t len) {
     uint32_t written = 0;
     while(written < len) {
-        int rv;
-        ASSERT((rv = write(fd, buf, len)) > 0);
+        int rv = write(fd, buf + written, len - written);
+        if (write_again(fd, rv)) continue;
+        ASSERT_ERRNO(rv);
+        ASSERT(rv > 0);
         written += rv;
     }
 }
 
+/* Same, but gather from multiple buffers.  The iovec is modified. */
+static void assert_writev(int fd, struct iovec *iov, int iovcnt) {
+    while(iovcnt) {
+        ssize_t rv = writev(fd, iov, iovcnt);
+        if (write_again(fd, rv)) continue;
+        ASSERT_ERRNO(rv);
+        ASSERT(rv > 0);
+        while(iovcnt && rv >= iov->iov_len) {
+            rv -= iov->iov_len;
+            iov++; iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (uint8_t*)iov->iov_base + rv;
+            iov->iov_len -= rv;
+        }
+    }
+}
+
+/* Raw mode serial port setup, shared by the stream ports.  Baud rates
+   are set with BOTHER, so any rate the UART can divide down to works,
+   not just the Bxxx constants.  ASYNC_LOW_LATENCY makes the driver
+   push received bytes to the tty layer right away, and for USB serial
+   adapters that support it, it also sets the latency timer to 1ms
+   instead of 16ms.  Not all drivers implement the serial ioctls, so
+   that part is best effort. */
+int tty_open(const char *dev, const struct tty_opts *o) {
+    int fd;
+    ASSERT_ERRNO(fd = open(dev, O_RDWR | O_NONBLOCK));
+
+    struct termios2 tio;
+    ASSERT(0 == ioctl(fd, TCGETS2, &tio));
+
+    // http://www.cs.uleth.ca/~holzmann/C/system/ttyraw.c
+    tio.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    tio.c_oflag &= ~(OPOST);
+    tio.c_cflag |= (CS8);
+    tio.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+
+    if (o && o->baud) {
+        /* Input speed follows output speed when CIBAUD is 0. */
+        tio.c_cflag &= ~(CBAUD | CIBAUD);
+        tio.c_cflag |= BOTHER;
+        tio.c_ispeed = tio.c_ospeed = o->baud;
+    }
+    if (o && o->rtscts) {
+        tio.c_cflag |= CRTSCTS;
+    }
+
+    ASSERT(0 == ioctl(fd, TCSETS2, &tio));
+
+    if (o && o->baud) {
+        ASSERT(0 == ioctl(fd, TCGETS2, &tio));
+        if (tio.c_ospeed != o->baud) {
+            LOG("%s: WARNING: asked for %d baud, got %d\n", dev, o->baud, tio.c_ospeed);
+        }
+    }
+    if (o && o->low_latency) {
+        struct serial_struct ss;
+        if (ioctl(fd, TIOCGSERIAL, &ss) ||
+            (ss.flags |= ASYNC_LOW_LATENCY, ioctl(fd, TIOCSSERIAL, &ss))) {
+            LOG("%s: WARNING: low latency not supported\n", dev);
+        }
+    }
+    return fd;
+}
+
+/* Bytes queued in the driver add latency to every frame behind them,
+   and the tty layer accepts a few kilobytes, no matter how large the
+   writes are.  With outq_max set, frames are held in user space while
+   the queue is above that size, e.g. the UART FIFO.  The port's
+   timeout method estimates when the queue will have drained from the
+   baud rate, at 10 bits per byte, and its flush method writes the
+   held frames then.  Writes never sleep, so the port can run under a
+   host event loop.  Frames that don't fit in the hold buffer are
+   dropped, as a full driver queue would. */
+#define TTY_HOLD_SIZE PORT_ENCODE_MAX(PACKET_MAX_SIZE)
+static uint32_t tty_fifo_size(int fd) {
+    struct serial_struct ss;
+    if (ioctl(fd, TIOCGSERIAL, &ss) || ss.xmit_fifo_size <= 0) return 16;
+    return ss.xmit_fifo_size;
+}
+static uint32_t tty_baud(int fd) {
+    struct termios2 tio;
+    ASSERT(0 == ioctl(fd, TCGETS2, &tio));
+    return tio.c_ospeed ? tio.c_ospeed : 9600;
+}
+static uint32_t tty_outq(struct buf_port *p) {
+    int outq;
+    ASSERT_ERRNO(ioctl(p->p.fd_out, TIOCOUTQ, &outq));
+    return outq;
+}
+/* Returns 1 if the frame was held or dropped instead of written. */
+static int tty_hold(struct buf_port *p, const struct iovec *iov, int iovcnt) {
+    if (!p->nb_hold && tty_outq(p) <= p->outq_max) return 0;
+    uint32_t len = 0;
+    for (int i=0; i<iovcnt; i++) len += iov[i].iov_len;
+    if (p->nb_hold + len > TTY_HOLD_SIZE) {
+        LOG("tty: output queue full, dropping frame\n");
+        return 1;
+    }
+    for (int i=0; i<iovcnt; i++) {
+        memcpy(&p->hold[p->nb_hold], iov[i].iov_base, iov[i].iov_len);
+        p->nb_hold += iov[i].iov_len;
+    }
+    return 1;
+}
+static int tty_timeout(struct buf_port *p) {
+    if (!p->nb_hold) return -1;
+    uint32_t outq = tty_outq(p);
+    if (outq <= p->outq_max) return 0;
+    return ((uint64_t)(outq - p->outq_max) * 10 * 1000 + p->baud - 1) / p->baud;
+}
+static void tty_flush(struct buf_port *p) {
+    if (!p->nb_hold || tty_outq(p) > p->outq_max) return;
+    assert_write(p->p.fd_out, p->hold, p->nb_hold);
+    p->nb_hold = 0;
+}
+/* Cut-through forwarding has no loop step to flush from, so it does
+ * wait. */
+static void tty_wait_outq(struct buf_port *p) {
+    for(;;) {
+        uint32_t outq = tty_outq(p);
+        if (outq <= p->outq_max) return;
+        uint64_t ns = (uint64_t)(outq - p->outq_max) * 10 * 1000000000ULL / p->baud;
+        struct timespec ts = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+/* CRC-32C (Castagnoli) for optional frame integrity checks on stream
+ * ports.  Uses the SSE4.2 crc32 instruction when the CPU has it, and
+ * slicing-by-8 tables otherwise. */
+
+#define CRC32C_POLY 0x82F63B78 // reflected
+
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_table(void) {
+    for (uint32_t i=0; i<256; i++) {
+        uint32_t crc = i;
+        for (int k=0; k<8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i=0; i<256; i++) {
+        for (int t=1; t<8; t++) {
+            uint32_t prev = crc32c_table[t-1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+        }
+    }
+}
+
+uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len) {
+    if (!crc32c_table[0][1]) crc32c_init_table();
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t lo = crc ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24));
+        uint32_t hi = buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((uint32_t)buf[7] << 24);
+        crc =
+            crc32c_table[7][lo & 0xFF] ^
+            crc32c_table[6][(lo >> 8) & 0xFF] ^
+            crc32c_table[5][(lo >> 16) & 0xFF] ^
+            crc32c_table[4][lo >> 24] ^
+            crc32c_table[3][hi & 0xFF] ^
+            crc32c_table[2][(hi >> 8) & 0xFF] ^
+            crc32c_table[1][(hi >> 16) & 0xFF] ^
+            crc32c_table[0][hi >> 24];
+        buf += 8; len -= 8;
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xFF];
+    }
+    return ~crc;
+}
+
+#ifdef HAVE_SSE42_CRC32C
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len) {
+    crc = ~crc;
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8; len -= 8;
+    }
+    crc = crc64;
+#endif
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, buf, 4);
+        crc = _mm_crc32_u32(crc, word);
+        buf += 4; len -= 4;
+    }
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *buf++);
+    }
+    return ~crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t len) {
+    static uint32_t (*fn)(uint32_t, const uint8_t *, size_t);
+    if (!fn) {
+        fn = crc32c_sw;
+#ifdef HAVE_SSE42_CRC32C
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2")) fn = crc32c_hw;
+#endif
+    }
+    return fn(crc, buf, len);
+}
+
+/* The frame check is appended to the payload, little endian. */
+static void crc32c_put(uint8_t *buf, uint32_t crc) {
+    for (int i=0; i<4; i++) { buf[i] = crc >> (8*i); }
+}
+static int crc32c_check(const uint8_t *buf, ssize_t len) {
+    if (len < 4) return 0;
+    uint32_t crc = 0;
+    for (int i=0; i<4; i++) { crc |= (uint32_t)buf[len-4+i] << (8*i); }
+    return crc == crc32c(0, buf, len-4);
+}
+
 
 
-/***** 1.1. TAP */
+/***** 1.1. TAP and TUN */
 
 static ssize_t tap_read(struct port *p, uint8_t *buf, ssize_t len) {
     ssize_t rlen;
@@ -98,15 +358,18 @@ static ssize_t tap_write(struct port *p, const uint8_t *buf, ssize_t len) {
     return write(p->fd, buf, len);
 }
 
-struct port *port_open_tap(const char *dev) {
+/* TAP carries Ethernet frames, TUN carries IPv4 and IPv6 packets.
+ * Both are opened without the packet information header. */
+static struct port *port_open_tuntap(const char *dev, short flags) {
     int fd;
     ASSERT_ERRNO(fd = open("/dev/net/tun", O_RDWR));
-    struct ifreq ifr = { .ifr_flags = IFF_TAP | IFF_NO_PI };
+    struct ifreq ifr = { .ifr_flags = flags | IFF_NO_PI };
     strncpy(ifr.ifr_name, dev, IFNAMSIZ);
     ASSERT_ERRNO(ioctl(fd, TUNSETIFF, (void *) &ifr));
-    LOG("tap: %s\n", dev);
+    LOG("%s: %s\n", flags == IFF_TAP ? "tap" : "tun", dev);
     struct port *port;
     ASSERT(port = malloc(sizeof(*port)));
+    memset(port,0,sizeof(*port));
     port->fd = fd;
     port->fd_out = fd;
     port->read = tap_read;
@@ -114,6 +377,12 @@ struct port *port_open_tap(const char *dev) {
     port->pop = 0;
     return port;
 }
+struct port *port_open_tap(const char *dev) {
+    return port_open_tuntap(dev, IFF_TAP);
+}
+struct port *port_open_tun(const char *dev) {
+    return port_open_tuntap(dev, IFF_TUN);
+}
 
 
 /***** 1.2. UDP */
@@ -123,6 +392,23 @@ struct udp_port {
     struct sockaddr_in peer;
 };
 
+/* Associate to first peer that sends to us.  This is to make setup
+   simpler.  After that, drop packets that do not come from peer. */
+static int udp_peer_ok(struct udp_port *p, struct sockaddr_in *peer) {
+    if (!p->peer.sin_port) {
+        memcpy(&p->peer, peer, sizeof(*peer));
+        log_addr(peer);
+        return 1;
+    }
+    if(memcmp(&p->peer, peer, sizeof(*peer))) {
+        LOG("WARNING: ununknown sender %d:\n", sizeof(*peer));
+        log_addr(peer);
+        //log_addr(&p->peer);
+        return 0;
+    }
+    return 1;
+}
+
 static ssize_t udp_read(struct udp_port *p, uint8_t *buf, ssize_t len) {
     //LOG("udp_read\n");
     ssize_t rlen = 0;
@@ -133,26 +419,9 @@ static ssize_t udp_read(struct udp_port *p, uint8_t *buf, ssize_t len) {
         rlen = recvfrom(p->p.fd, buf, len, flags,
                         (struct sockaddr*)&peer, &addrlen));
     ASSERT(addrlen == sizeof(peer));
-
-    /* Associate to first peer that sends to us.  This is to make
-       setup simpler. */
-    if (!p->peer.sin_port) {
-        memcpy(&p->peer, &peer, sizeof(peer));
-        log_addr(&peer);
-        goto done;
-    }
-    /* After that, drop packets that do not come from peer. */
-    if(memcmp(&p->peer, &peer, sizeof(peer))) {
-        LOG("WARNING: ununknown sender %d:\n", sizeof(peer));
-        log_addr(&peer);
-        //log_addr(&p->peer);
-        rlen = 0;
-        goto done;
-    }
-  done:
+    if (!udp_peer_ok(p, &peer)) rlen = 0;
     //LOG("udp_read %d\n", rlen);
     return rlen;
-
 }
 static ssize_t udp_write(struct udp_port *p, uint8_t *buf, ssize_t len) {
     if (p->peer.sin_port == 0) {
@@ -195,6 +464,34 @@ struct port *port_open_udp(uint16_t port) {
 
     return &p->p;
 }
+struct port *port_open_udp_connect(const char *host, uint16_t port) {
+    struct port *p = port_open_udp(0); // don't spec port here
+    struct udp_port *up = (void*)p;
+
+    struct hostent *hp;
+    ASSERT(hp = gethostbyname(host));
+    memcpy((char *)&up->peer.sin_addr,
+           (char *)hp->h_addr_list[0],
+           hp->h_length);
+    up->peer.sin_port = htons(port);
+    up->peer.sin_family = AF_INET;
+
+    // FIXME: Send some meaningful ethernet packet instead
+    // FIXME: Make this optional?  Or require application to initiate?
+#if 0
+    uint8_t buf[] = {
+        0x55,0x55,0x55,0x55,0x55,0x55,
+        0x55,0x55,0x55,0x55,0x55,0x55,
+        0x55,0x55
+    };
+    LOG("udp: hello to ");
+    log_addr(&up->peer);
+    ASSERT(sizeof(buf) == p->write(p, buf, sizeof(buf)));
+#else
+    LOG("udp: not sending hello\n");
+#endif
+    return p;
+}
 
 
 /***** 1.3. PACKETN */
@@ -208,11 +505,46 @@ struct port *port_open_udp(uint16_t port) {
 /* The read method can be shared, parameterized by a protocol-specific
  * "pop" method that attempts to read a packet from the buffer. */
 
-struct buf_port {
-    struct port p;
-    uint32_t count;
-    uint8_t buf[2*PACKET_MAX_SIZE];
-};
+/* Popping a frame only advances head.  Data is moved to the front
+ * of the buffer when there is not enough room left for a frame, so
+ * each byte is moved at most once. */
+uint8_t *buf_port_reserve(struct buf_port *p, uint32_t *room) {
+    if (p->head == p->count) {
+        p->head = p->count = 0;
+    }
+    else if (sizeof(p->buf) - p->count < PACKET_MAX_SIZE) {
+        memmove(&p->buf[0], &p->buf[p->head], p->count - p->head);
+        p->count -= p->head;
+        p->head = 0;
+    }
+    *room = sizeof(p->buf) - p->count;
+    return &p->buf[p->count];
+}
+
+/* Write side counterpart: a port with BUF_PORT_CORK is corked on the
+ * second write of a loop step and uncorked by its flush method, see
+ * TCP below.  Writes outside a step, e.g. from a host event loop,
+ * have no flush to follow them, so they are not corked.  A tty port
+ * with an output queue limit may hold the frame instead, see
+ * tty_hold().  The iovec is modified. */
+static void stream_writev(struct buf_port *p, struct iovec *iov, int iovcnt) {
+    if (p->outq_max && tty_hold(p, iov, iovcnt)) return;
+    if ((p->flags & BUF_PORT_CORK) && p->p.batch && p->writes++ == 1) {
+        ASSERT_ERRNO(setsockopt(p->p.fd_out, IPPROTO_TCP, TCP_CORK, &(int){ 1 }, sizeof(int)));
+    }
+    assert_writev(p->p.fd_out, iov, iovcnt);
+}
+static void stream_write(struct buf_port *p, uint8_t *buf, uint32_t len) {
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    stream_writev(p, &iov, 1);
+}
+static void stream_flush(struct buf_port *p) {
+    if (p->writes > 1) {
+        ASSERT_ERRNO(setsockopt(p->p.fd_out, IPPROTO_TCP, TCP_CORK, &(int){ 0 }, sizeof(int)));
+    }
+    p->writes = 0;
+}
+
 static ssize_t pop_read(port_pop_fn pop,
                         struct buf_port *p, uint8_t *buf, ssize_t len) {
     ssize_t size;
@@ -220,11 +552,15 @@ static ssize_t pop_read(port_pop_fn pop,
     if ((size = pop(p, buf, len))) return size;
 
     /* We get only one read() call, so make it count. */
-    uint32_t room = sizeof(p->buf) - p->count;
+    uint32_t room;
+    uint8_t *tail = buf_port_reserve(p, &room);
+    /* The decoders make room by dropping frames that can't fit.  A
+     * read of 0 bytes would look like end of file. */
+    if (!room) ERROR("stream frame does not fit in buffer\n");
     //LOG("packetn_read %d\n", p->count);
-    ssize_t rv = read(p->p.fd, &p->buf[p->count], room);
+    ssize_t rv = read(p->p.fd, tail, room);
     if (rv > 0) {
-        //log_hex(&p->buf[p->count], rv);
+        //log_hex(tail, rv);
     }
     //LOG("packetn_read done %d\n", rv);
     if (rv == -1) {
@@ -248,78 +584,110 @@ static ssize_t pop_read(port_pop_fn pop,
 struct packetn_port {
     struct buf_port p;
     uint32_t len_bytes;
+    uint8_t resync;  // looking for a valid frame, only logged once
 };
 
 uint32_t packetn_packet_size(struct packetn_port *p) {
     ASSERT(p->len_bytes <= 4);
-    ASSERT(p->p.count >= p->len_bytes);
+    ASSERT(p->p.count - p->p.head >= p->len_bytes);
     uint32_t size = 0;
     for (uint32_t i=0; i<p->len_bytes; i++) {
-        size = (size << 8) + p->p.buf[i];
+        size = (size << 8) + p->p.buf[p->p.head + i];
     }
     //LOG("size %d\n", size);
     return size;
 }
-uint32_t packetn_packet_write_size(struct packetn_port *p, uint32_t size, uint8_t *buf) {
-    ASSERT(p->len_bytes <= 4);
-    for (uint32_t i=0; i<p->len_bytes; i++) {
-        buf[p->len_bytes-1-i] = size & 0xFF;
+uint32_t packetn_packet_write_size(uint32_t len_bytes, uint32_t size, uint8_t *buf) {
+    ASSERT(len_bytes <= 4);
+    for (uint32_t i=0; i<len_bytes; i++) {
+        buf[len_bytes-1-i] = size & 0xFF;
         size = size >> 8;
     }
     return size;
 }
 
 static ssize_t packetn_pop(struct packetn_port *p, uint8_t *buf, ssize_t len) {
+    int crc = p->p.flags & BUF_PORT_CRC32C;
+  again:
     /* Make sure there are enough bytes to get the size field. */
-    if (p->p.count < p->len_bytes) return 0;
+    if (p->p.count - p->p.head < p->len_bytes) return 0;
     uint32_t size = packetn_packet_size(p);
 
     /* Packets are assumed to fit in the buffer.  An error here is
-     * likely a bug or a protocol {packet,N} framing error. */
-    if (sizeof(p->p.buf) < p->len_bytes + size) {
+     * likely a bug or a protocol {packet,N} framing error.  With
+     * frame checks enabled, it is treated as loss of sync. */
+    if (PACKET_MAX_SIZE + (crc ? 4 : 0) < size) {
+        if (crc) goto resync;
         ERROR("buffer overflow for stream packet size=%d\n", size);
     }
 
     /* Ensure packet is complete and fits in output buffer before
      * copying.  Skip the size prefix, which is used only for stream
      * transport framing. */
-    if (p->p.count < p->len_bytes + size) return 0;
+    if (p->p.count - p->p.head < p->len_bytes + size) return 0;
+    const uint8_t *frame = &p->p.buf[p->p.head + p->len_bytes];
+    if (crc) {
+        /* On mismatch, the length prefix can't be trusted either.
+         * Skip a single byte and try again until a frame checks out. */
+        if (!crc32c_check(frame, size)) goto resync;
+        size -= 4;
+    }
     ASSERT(size <= len);
-    memcpy(buf, &p->p.buf[p->len_bytes], size);
+    memcpy(buf, frame, size);
     //LOG("copied %d:\n", size);
     //log_hex(buf, size);
+    p->p.head += p->len_bytes + size + (crc ? 4 : 0);
 
+    /* Empty packets carry no data, and a 0 return value means there
+     * is no complete packet, so skip them. */
+    if (!size) goto again;
+    p->resync = 0;
 
-    /* If there is anything residue, move it to the front. */
-    if (p->p.count == p->len_bytes+size) {
-        p->p.count = 0;
-    }
-    else {
-        ssize_t head_count = p->len_bytes + size;
-        ssize_t tail_count = p->p.count - head_count;
-        memmove(&p->p.buf[0], &p->p.buf[head_count], tail_count);
-        //LOG("moved %d %d:\n", p->count, tail_count);
-        //log_hex(&p->buf[0],tail_count);
-        p->p.count = tail_count;
-    }
-    //LOG("pop: %d %d\n", size, p->count);
+    //LOG("pop: %d %d\n", size, p->p.count);
     return size;
+
+  resync:
+    if (!p->resync) LOG("packetn: bad frame, resyncing\n");
+    p->resync = 1;
+    p->p.head++;
+    goto again;
 }
 
 static ssize_t packetn_read(struct packetn_port *p, uint8_t *buf, ssize_t len) {
     return pop_read((port_pop_fn)packetn_pop, &p->p, buf, len);
 }
 
+static ssize_t packetn_encode(struct packetn_port *p, uint8_t *out, const uint8_t *buf, ssize_t len) {
+    ssize_t total = p->len_bytes + len;
+    memcpy(&out[p->len_bytes], buf, len);
+    if (p->p.flags & BUF_PORT_CRC32C) {
+        crc32c_put(&out[total], crc32c(0, buf, len));
+        total += 4;
+    }
+    packetn_packet_write_size(p->len_bytes, total - p->len_bytes, out);
+    return total;
+}
+/* The write method does not use the encoder, to avoid copying the
+ * payload. */
 static ssize_t packetn_write(struct packetn_port *p, uint8_t *buf, ssize_t len) {
-    int fd = p->p.p.fd_out;
-
     //LOG("packetn_write %d\n", len);
     uint8_t size[p->len_bytes];
-    packetn_packet_write_size(p, len, &size[0]);
-    assert_write(fd, &size[0], p->len_bytes);
-    assert_write(fd, buf, len);
+    uint8_t check[4];
+    struct iovec iov[] = {
+        { .iov_base = size, .iov_len = p->len_bytes },
+        { .iov_base = buf,  .iov_len = len },
+        { .iov_base = check, .iov_len = 4 },
+    };
+    int iovcnt = 2;
+    if (p->p.flags & BUF_PORT_CRC32C) {
+        crc32c_put(check, crc32c(0, buf, len));
+        iovcnt = 3;
+    }
+    ssize_t total = p->len_bytes + len + (iovcnt == 3 ? 4 : 0);
+    packetn_packet_write_size(p->len_bytes, total - p->len_bytes, &size[0]);
+    stream_writev(&p->p, iov, iovcnt);
     //LOG("packetn_write %d (done)\n", len);
-    return len + p->len_bytes;
+    return total;
 }
 struct port *port_open_packetn_stream(uint32_t len_bytes, int fd, int fd_out) {
     struct packetn_port *p;
@@ -330,26 +698,13 @@ struct port *port_open_packetn_stream(uint32_t len_bytes, int fd, int fd_out) {
     p->p.p.read  = (port_read_fn)packetn_read;
     p->p.p.write = (port_write_fn)packetn_write;
     p->p.p.pop   = (port_pop_fn)packetn_pop;
+    p->p.p.encode = (port_encode_fn)packetn_encode;
+    p->p.p.framing = len_bytes;
     p->len_bytes = len_bytes;
     return &p->p.p;
 }
 struct port *port_open_packetn_tty(uint32_t len_bytes, const char *dev) {
-    int fd;
-    ASSERT_ERRNO(fd = open(dev, O_RDWR | O_NONBLOCK));
-
-    struct termios2 tio;
-    ASSERT(0 == ioctl(fd, TCGETS2, &tio));
-
-    // http://www.cs.uleth.ca/~holzmann/C/system/ttyraw.c
-    tio.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-    tio.c_oflag &= ~(OPOST);
-    tio.c_cflag |= (CS8);
-    tio.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    tio.c_cc[VMIN] = 1;
-    tio.c_cc[VTIME] = 0;
-
-    ASSERT(0 == ioctl(fd, TCSETS2, &tio));
-
+    int fd = tty_open(dev, NULL);
     return port_open_packetn_stream(len_bytes, fd, fd);
 }
 
@@ -373,86 +728,167 @@ struct port *port_open_packetn_tty(uint32_t len_bytes, const char *dev) {
 
 struct slip_port {
     struct buf_port p;
+    /* Decoder state is kept across calls, such that each input byte
+     * is examined only once when a frame arrives in small pieces.
+     * Decoded data is written in place, at the front of the frame in
+     * the input buffer.  Offsets are relative to p.head. */
+    uint32_t scan;  // next input byte to decode
+    uint32_t out;   // size of decoded data
+    uint8_t esc;    // last byte was SLIP_ESC
+    uint8_t drop;   // discard input up to the next SLIP_END
 };
 
 /* Try to pop a frame.  If it's not complete, return 0.  p->buf
- * contains slip-encoded data.  It is allowed to use the output buffer
- * to perform partial decoding. */
+ * contains slip-encoded data.  Bad frames are dropped, after which
+ * the decoder picks up again at the next frame boundary. */
 static ssize_t slip_pop(struct slip_port *p, uint8_t *buf, ssize_t len) {
-
-    // 1. Go over data and stop at packet boundary, writing partial
-    // data to output buffer.  Abort with 0 size when packet is
-    // incomplete.
-    ssize_t in = 0, out = 0;
+    uint8_t *frame = &p->p.buf[p->p.head];
+    uint32_t avail = p->p.count - p->p.head;
+    uint32_t in = p->scan, out = p->out;
+    uint8_t esc = p->esc, drop = p->drop;
+    int crc = p->p.flags & BUF_PORT_CRC32C;
+
+    // 1. Decode up to the packet boundary.  Save state and abort with
+    // 0 size when packet is incomplete.
     for(;;) {
-        ASSERT(out < len);
-        if (in >= p->p.count) return 0;
-        uint8_t c = p->p.buf[in++];
-        if (SLIP_END == c) {
-            break;
+        if (in >= avail) {
+            /* A frame that fills the whole buffer can't complete. */
+            if (in == sizeof(p->p.buf)) {
+                LOG("slip: frame too large\n");
+                drop = 1;
+            }
+            /* Dropped input doesn't need to be kept, so it doesn't
+             * fill up the buffer when no delimiter shows up. */
+            if (drop) {
+                p->p.head += in;
+                in = 0;
+                out = 0;
+            }
+            p->scan = in;
+            p->out = out;
+            p->esc = esc;
+            p->drop = drop;
+            return 0;
         }
-        else if (SLIP_ESC == c) {
-            if (in >= p->p.count) return 0;
-            uint8_t c = p->p.buf[in++];
+        uint8_t c = frame[in++];
+        if (esc) {
+            esc = 0;
             if (SLIP_ESC_ESC == c) {
-                buf[out++] = SLIP_ESC;
+                c = SLIP_ESC;
             }
             else if (SLIP_ESC_END == c) {
-                buf[out++] = SLIP_END;
+                c = SLIP_END;
             }
             else {
-                ERROR("bad slip escape %d\n", (int)c);
+                LOG("bad slip escape %d\n", (int)c);
+                drop = 1;
+                /* The delimiter itself is still a frame boundary. */
+                if (SLIP_END == c) goto boundary;
+                continue;
             }
         }
-        else {
-            buf[out++] = c;
+        else if (SLIP_ESC == c) {
+            esc = !drop;
+            continue;
+        }
+        else if (SLIP_END == c) {
+          boundary:
+            if (!drop && crc && out) {
+                if (!crc32c_check(frame, out)) {
+                    LOG("slip: bad frame check, dropping %d bytes\n", out);
+                    drop = 1;
+                }
+                else {
+                    out -= 4;
+                }
+            }
+            if (out && !drop) break;
+            /* Skip empty or dropped packets, e.g. the leading
+             * delimiter written by slip_write().  A checked frame
+             * can be empty too, once the check is removed. */
+            p->p.head += in;
+            frame += in;
+            avail -= in;
+            in = 0;
+            out = 0;
+            drop = 0;
+            continue;
+        }
+        if (drop) continue;
+        if (out >= len + (crc ? 4 : 0)) {
+            LOG("slip: frame too large\n");
+            drop = 1;
+            continue;
         }
+        frame[out++] = c;
     }
 
-    //LOG("slip_pop: "); log_hex(&p->p.buf[0], in);
-
-
-    // 2. Shift the data buffer
-    memmove(&p->p.buf[0], &p->p.buf[in], p->p.count-in);
-    p->p.count -= in;
+    //LOG("slip_pop: "); log_hex(frame, out);
 
+    // 2. Copy out and drop the encoded frame from the buffer.
+    memcpy(buf, frame, out);
+    p->p.head += in;
+    p->scan = 0;
+    p->out = 0;
+    p->esc = 0;
+    p->drop = 0;
     return out;
 }
 static ssize_t slip_read(struct packetn_port *p, uint8_t *buf, ssize_t len) {
     return pop_read((port_pop_fn)slip_pop, &p->p, buf, len);
 }
 
-static ssize_t slip_write(struct slip_port *p, uint8_t *buf, ssize_t len) {
-    /* Use a temporary buffer to avoid multiple write() calls.  Worst
-     * case size is x2, when each character is escaped, plus 2 for
-     * double-ended delimiters. */
-    uint8_t tmp[len*2 + 2];
-
+static ssize_t slip_encode_bytes(uint8_t *out_buf, const uint8_t *buf, ssize_t len) {
     ssize_t out = 0;
-
-    /* Convention: write packet boundary at the beginning and the
-     * start.  Receiver needs to throw away empty (or otherwise
-     * invalid) packets. */
-    tmp[out++] = SLIP_END;
     for(ssize_t in=0; in<len; in++) {
         int c_in = buf[in];
         if (SLIP_END == c_in) {
-            tmp[out++] = SLIP_ESC;
-            tmp[out++] = SLIP_ESC_END;
+            out_buf[out++] = SLIP_ESC;
+            out_buf[out++] = SLIP_ESC_END;
         }
         else if (SLIP_ESC == c_in) {
-            tmp[out++] = SLIP_ESC;
-            tmp[out++] = SLIP_ESC_ESC;
+            out_buf[out++] = SLIP_ESC;
+            out_buf[out++] = SLIP_ESC_ESC;
         }
         else {
-            tmp[out++] = c_in;
+            out_buf[out++] = c_in;
         }
     }
-    tmp[out++] = SLIP_END;
+    return out;
+}
+ssize_t slip_encode(uint8_t *out_buf, const uint8_t *buf, ssize_t len) {
+    ssize_t out = 0;
+
+    /* Convention: write packet boundary at the beginning and the
+     * start.  Receiver needs to throw away empty (or otherwise
+     * invalid) packets. */
+    out_buf[out++] = SLIP_END;
+    out += slip_encode_bytes(&out_buf[out], buf, len);
+    out_buf[out++] = SLIP_END;
+    return out;
+}
+ssize_t slip_encode_crc(uint8_t *out_buf, const uint8_t *buf, ssize_t len) {
+    uint8_t check[4];
+    crc32c_put(check, crc32c(0, buf, len));
+    ssize_t out = 0;
+    out_buf[out++] = SLIP_END;
+    out += slip_encode_bytes(&out_buf[out], buf, len);
+    out += slip_encode_bytes(&out_buf[out], check, 4);
+    out_buf[out++] = SLIP_END;
+    return out;
+}
+static ssize_t slip_port_encode(struct slip_port *p, uint8_t *out, const uint8_t *buf, ssize_t len) {
+    return (p->p.flags & BUF_PORT_CRC32C) ?
+        slip_encode_crc(out, buf, len) : slip_encode(out, buf, len);
+}
+static ssize_t slip_write(struct slip_port *p, uint8_t *buf, ssize_t len) {
+    /* Use a temporary buffer to avoid multiple write() calls. */
+    uint8_t tmp[SLIP_ENCODE_MAX(len)];
+    ssize_t out = slip_port_encode(p, tmp, buf, len);
 
     //LOG("slip_write: "); log_hex(tmp, out);
 
-    assert_write(p->p.p.fd_out, tmp, out);
+    stream_write(&p->p, tmp, out);
     return out;
 }
 struct port *port_open_slip_stream(int fd, int fd_out) {
@@ -464,25 +900,11 @@ struct port *port_open_slip_stream(int fd, int fd_out) {
     p->p.p.read  = (port_read_fn)slip_read;
     p->p.p.write = (port_write_fn)slip_write;
     p->p.p.pop   = (port_pop_fn)slip_pop;
+    p->p.p.encode = (port_encode_fn)slip_port_encode;
     return &p->p.p;
 }
 struct port *port_open_slip_tty(const char *dev) {
-    int fd;
-    ASSERT_ERRNO(fd = open(dev, O_RDWR | O_NONBLOCK));
-
-    struct termios2 tio;
-    ASSERT(0 == ioctl(fd, TCGETS2, &tio));
-
-    // http://www.cs.uleth.ca/~holzmann/C/system/ttyraw.c
-    tio.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-    tio.c_oflag &= ~(OPOST);
-    tio.c_cflag |= (CS8);
-    tio.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    tio.c_cc[VMIN] = 1;
-    tio.c_cc[VTIME] = 0;
-
-    ASSERT(0 == ioctl(fd, TCSETS2, &tio));
-
+    int fd = tty_open(dev, NULL);
     return port_open_slip_stream(fd, fd);
 }
 
@@ -491,7 +913,10 @@ struct port *port_open_slip_tty(const char *dev) {
 /***** 1.5. HEX */
 struct hex_port {
     struct buf_port p;
-    FILE *f_out;
+    /* Incremental decoder state, see struct slip_port. */
+    uint32_t scan;
+    uint32_t out;
+    int nibble;  // first digit of a byte, or -1
 };
 
 
@@ -504,42 +929,58 @@ static int hexdigit(int c) {
 
 
 static ssize_t hex_pop(struct hex_port *p, uint8_t *buf, ssize_t len) {
+    uint8_t *frame = &p->p.buf[p->p.head];
+    uint32_t avail = p->p.count - p->p.head;
+    uint32_t in = p->scan, out = p->out;
+    int nibble = p->nibble;
 
-    // 1. Go over data and stop at packet boundary, writing partial
-    // data to output buffer.  Abort with 0 size when packet is
-    // incomplete.
-    ssize_t in = 0, out = 0;
+    // 1. Decode up to the packet boundary.  Save state and abort with
+    // 0 size when packet is incomplete.
     for(;;) {
-        ASSERT(out < len);
-
-        if (in >= p->p.count) return 0;
-        uint8_t c1 = p->p.buf[in++];
+        if (in >= avail) {
+            p->scan = in;
+            p->out = out;
+            p->nibble = nibble;
+            return 0;
+        }
+        uint8_t c = frame[in++];
 
         /* Check any control characters. */
-        if (c1 == '\n') {
-            /* Newline terminates. */
-            break;
-        };
-        if (c1 == ' ') {
-            /* Spaces are allowed inbetween hex bytes. */
-            continue;
+        if (nibble < 0) {
+            if (c == '\n') {
+                /* Newline terminates.  Skip empty lines. */
+                if (out) break;
+                p->p.head += in;
+                frame += in;
+                avail -= in;
+                in = 0;
+                continue;
+            }
+            if (c == ' ') {
+                /* Spaces are allowed inbetween hex bytes. */
+                continue;
+            }
         }
 
         /* The only legal case left is two valid hex digits. */
-        if (in >= p->p.count) return 0;
-        uint8_t c2 = p->p.buf[in++];
-
-        int d1, d2;
-        ASSERT(-1 != (d1 = hexdigit(c1)));
-        ASSERT(-1 != (d2 = hexdigit(c2)));
-
-        buf[out++] = (d1 << 4) + d2;
+        int d;
+        ASSERT(-1 != (d = hexdigit(c)));
+        if (nibble < 0) {
+            nibble = d;
+        }
+        else {
+            ASSERT(out < len);
+            frame[out++] = (nibble << 4) + d;
+            nibble = -1;
+        }
     }
 
-    // 2. Shift the data buffer
-    memmove(&p->p.buf[0], &p->p.buf[in], p->p.count-in);
-    p->p.count -= in;
-
+    // 2. Copy out and drop the encoded frame from the buffer.
+    memcpy(buf, frame, out);
+    p->p.head += in;
+    p->scan = 0;
+    p->out = 0;
+    p->nibble = -1;
     return out;
 }
 
@@ -547,11 +988,24 @@ static ssize_t hex_pop(struct hex_port *p, uint8_t *buf, ssize_t len) {
 static ssize_t hex_read(struct hex_port *p, uint8_t *buf, ssize_t len) {
     return pop_read((port_pop_fn)hex_pop, &p->p, buf, len);
 }
-static ssize_t hex_write(struct hex_port *p, uint8_t *buf, ssize_t len) {
+ssize_t hex_encode(uint8_t *out_buf, const uint8_t *buf, ssize_t len) {
+    static const char digit[] = "0123456789abcdef";
     ssize_t out = 0;
-    for (ssize_t i=0; i<len; i++) { out += fprintf(p->f_out, " %02x", buf[i]); }
-    out += fprintf(p->f_out, "\n");
-    fflush(p->f_out);
+    for (ssize_t i=0; i<len; i++) {
+        out_buf[out++] = ' ';
+        out_buf[out++] = digit[buf[i] >> 4];
+        out_buf[out++] = digit[buf[i] & 0xF];
+    }
+    out_buf[out++] = '\n';
+    return out;
+}
+static ssize_t hex_port_encode(struct hex_port *p, uint8_t *out, const uint8_t *buf, ssize_t len) {
+    return hex_encode(out, buf, len);
+}
+static ssize_t hex_write(struct hex_port *p, uint8_t *buf, ssize_t len) {
+    uint8_t tmp[HEX_ENCODE_MAX(len)];
+    ssize_t out = hex_encode(tmp, buf, len);
+    stream_write(&p->p, tmp, out);
     return out;
 }
 struct port *port_open_hex_stream(int fd, int fd_out) {
@@ -563,74 +1017,1191 @@ struct port *port_open_hex_stream(int fd, int fd_out) {
     p->p.p.read  = (port_read_fn)hex_read;
     p->p.p.write = (port_write_fn)hex_write;
     p->p.p.pop   = (port_pop_fn)hex_pop;
-    p->f_out = fdopen(fd_out, "w");
+    p->p.p.encode = (port_encode_fn)hex_port_encode;
+    p->nibble = -1;
     return &p->p.p;
 }
 
 
 
 
-/***** 2. PACKET HANDLER */
-
-/* Default behavior for the stand-alone program is to just forward a
- * packet to the other port.  Any other processing behavior is left to
- * application code that uses packet_bridge as a library.. */
-
-void packet_forward(struct packet_handle_ctx *x, int from, const uint8_t *buf, ssize_t len) {
-    int to = (from == 0) ? 1 : 0;
-    x->port[to]->write(x->port[to], buf, len);
-}
+/***** 1.6. BONDED UDP */
 
+/* Spread packets over multiple UDP paths, e.g. one per uplink.  Each
+   path is a UDP port as above, so paths can be listening or
+   connecting.  All path sockets are added to an epoll instance, which
+   is the port's fd.
 
+   Each packet gets a 32 bit big endian sequence number trailer.  A
+   trailer instead of a header, so the payload can be received in
+   place.
 
+   By default a path is picked by hashing the flow: IP addresses, and
+   ports for TCP and UDP.  Packets are Ethernet frames, or IP packets
+   with BOND_IP.  That keeps packets of a flow in order, but
+   a single flow can't use more than one path.  In round robin mode,
+   packets are spread by weight and the receiver puts them back in
+   order using a small reorder window.  Gaps are skipped when a
+   packet arrives that does not fit the window, or when packets have
+   been held for BOND_HOLD_NS.  The deadline is reported through the
+   port's timeout method, so the loop wakes up for it. */
 
+#define BOND_MAX_PATHS 8
+#define BOND_WINDOW 8
+#define BOND_HOLD_NS 5000000LL  // longest wait for a gap to fill
+#define BOND_DOWN_NS 1000000000LL  // path not used after an error
 
+struct bond_port {
+    struct port p;
+    int nb_paths;
+    struct udp_port *path[BOND_MAX_PATHS];
+    uint32_t weight[BOND_MAX_PATHS];
+    uint32_t total_weight;
+    uint64_t down_until[BOND_MAX_PATHS]; // after a socket error
+    int rr;
+    int ip;            // packets are IP, not Ethernet
+    /* Transmit */
+    uint32_t tx_seq;
+    int tx_path;
+    uint32_t tx_credit;
+    /* Receive, round robin only */
+    int rx_sync;       // rx_seq is valid
+    uint32_t rx_seq;   // next expected sequence number
+    int nb_held;
+    uint64_t hold_until; // deadline while nb_held > 0
+    int flush;         // deliver held packets up to overflow_seq
+    uint32_t overflow_seq;
+    ssize_t overflow_len;
+    uint8_t overflow[PACKET_MAX_SIZE];
+    struct {
+        int valid;
+        uint32_t seq;
+        ssize_t len;
+        uint8_t buf[PACKET_MAX_SIZE];
+    } slot[BOND_WINDOW];
+};
 
-/***** 3. FRAMEWORK */
+/* Flow hash over the inner headers, of an Ethernet frame from a TAP
+   port, or of an IP packet from a TUN port if ip is set.  The caller
+   needs to say which, since an IP packet can look like an Ethernet
+   frame, e.g. bytes 12-13 are the start of the IPv4 source address.
+   Ethernet frames that are not IP are hashed on the addresses. */
+uint32_t packet_flow_hash(const uint8_t *buf, ssize_t len, int ip_only) {
+    ssize_t l3 = 0;
+    if (!ip_only) {
+        if (len < 14) return crc32c(0, buf, len < 12 ? len : 12);
+        ssize_t type_offset = 12;
+        uint16_t type = (buf[12] << 8) | buf[13];
+        if (type == 0x8100 && len >= 18) {
+            type_offset = 16;
+            type = (buf[16] << 8) | buf[17];
+        }
+        if (type != 0x0800 && type != 0x86DD) return crc32c(0, buf, 12);
+        l3 = type_offset + 2;
+    }
 
-void packet_loop(packet_handle_fn handle,
-                 struct packet_handle_ctx *ctx) {
-    const char progress[] = "-\\|/";
-    uint32_t count = 0;
+    const uint8_t *ip = &buf[l3];
+    ssize_t ip_len = len - l3;
+    uint8_t key[37];
+    ssize_t n = 0, l4 = -1;
+    uint8_t proto = 0;
+    if (ip_len >= 20 && (ip[0] >> 4) == 4) {
+        memcpy(&key[n], &ip[12], 8); n += 8;
+        proto = ip[9];
+        /* Only the first fragment has ports. */
+        int frag = ((ip[6] & 0x1F) << 8) | ip[7];
+        if (!frag) l4 = (ip[0] & 0xF) * 4;
+    }
+    else if (ip_len >= 40 && (ip[0] >> 4) == 6) {
+        memcpy(&key[n], &ip[8], 32); n += 32;
+        proto = ip[6];
+        l4 = 40;
+    }
+    else {
+        return crc32c(0, ip, ip_len < 8 ? ip_len : 8);
+    }
+    key[n++] = proto;
+    if ((proto == 6 || proto == 17) && l4 >= 0 && ip_len >= l4 + 4) {
+        memcpy(&key[n], &ip[l4], 4); n += 4;
+    }
+    return crc32c(0, key, n);
+}
 
-    struct pollfd pfd[ctx->nb_ports];
-    memset(pfd, 0, sizeof(pfd));
+static uint64_t bond_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    for (int i=0; i<ctx->nb_ports; i++) {
-        pfd[i].fd = ctx->port[i]->fd;
-        pfd[i].events = POLLERR | POLLIN;
+static int bond_path_up(struct bond_port *p, int i) {
+    if (p->down_until[i]) {
+        if (bond_now() < p->down_until[i]) return 0;
+        p->down_until[i] = 0;
+        LOG("bond: path %d retry\n", i);
     }
-    for(;;) {
-        uint8_t buf[PACKET_MAX_SIZE]; // FIXME: Make this configurable
-        int rv;
-        ASSERT_ERRNO(rv = poll(&pfd[0], 2, ctx->timeout));
-        ASSERT(rv >= 0);
-        for (int i=0; i<ctx->nb_ports; i++) {
-            if(pfd[i].revents & POLLIN) {
-                struct port *in  = ctx->port[i];
-
-                /* The read calls the underlying OS read method only
-                 * once, so we are guaranteed to not block. */
-                int rlen = in->read(in, buf, sizeof(buf));
-                if (rlen) {
-                    handle(ctx, i, buf, rlen);
-                    count++;
-                }
-                else {
-                    /* Port handler read data but dropped it. */
-                }
+    return p->path[i]->peer.sin_port != 0;
+}
 
-                /* For streaming ports, it is possible that the OS
-                 * read method returned multiple packets, so we pop
-                 * them one by one. */
-                if (in->pop) {
-                    while((rlen = in->pop((struct buf_port *)in, buf, sizeof(buf)))) {
-                        handle(ctx, i, buf, rlen);
-                        count++;
-                    }
-                }
-            }
+/* Socket errors, e.g. an uplink that went away or an ICMP error from
+   the peer, take the path out of use for a while instead of taking
+   down the bond. */
+static void bond_path_error(struct bond_port *p, int i) {
+    LOG("bond: path %d down: %s\n", i, strerror(errno));
+    p->down_until[i] = bond_now() + BOND_DOWN_NS;
+}
+
+static int bond_pick_path(struct bond_port *p, const uint8_t *buf, ssize_t len) {
+    int i;
+    if (p->rr) {
+        if (!p->tx_credit) {
+            p->tx_path = (p->tx_path + 1) % p->nb_paths;
+            p->tx_credit = p->weight[p->tx_path];
         }
+        p->tx_credit--;
+        i = p->tx_path;
+    }
+    else {
+        uint32_t h = packet_flow_hash(buf, len, p->ip) % p->total_weight;
+        for (i=0; h >= p->weight[i]; i++) h -= p->weight[i];
+    }
+    /* Paths that are not associated yet are skipped. */
+    for (int n=0; n<p->nb_paths; n++) {
+        int j = (i + n) % p->nb_paths;
+        if (bond_path_up(p, j)) return j;
+    }
+    return -1;
+}
+
+static ssize_t bond_write(struct bond_port *p, const uint8_t *buf, ssize_t len) {
+    uint8_t seq[4];
+    for (int k=0; k<4; k++) seq[k] = p->tx_seq >> (24 - 8*k);
+    p->tx_seq++;
+    /* On error, fall over to the next path that is up. */
+    for (int tries=0; tries<p->nb_paths; tries++) {
+        int i = bond_pick_path(p, buf, len);
+        if (i < 0) return 0; // drop while not associated
+        struct udp_port *path = p->path[i];
+        struct iovec iov[] = {
+            { .iov_base = (void*)buf, .iov_len = len },
+            { .iov_base = seq, .iov_len = 4 },
+        };
+        struct msghdr msg = {
+            .msg_name = &path->peer,
+            .msg_namelen = sizeof(path->peer),
+            .msg_iov = iov,
+            .msg_iovlen = 2,
+        };
+        ssize_t wlen = sendmsg(path->p.fd, &msg, 0);
+        if (wlen >= 0) return wlen;
+        bond_path_error(p, i);
+    }
+    return 0;
+}
+
+/* Deliver held packets in order. */
+static ssize_t bond_pop(struct bond_port *p, uint8_t *buf, ssize_t len) {
+    int expired = p->nb_held && bond_now() >= p->hold_until;
+    for(;;) {
+        if (p->flush && !p->nb_held) {
+            /* Everything before the overflow packet is out. */
+            p->flush = 0;
+            p->rx_seq = p->overflow_seq + 1;
+            ASSERT(p->overflow_len <= len);
+            memcpy(buf, p->overflow, p->overflow_len);
+            return p->overflow_len;
+        }
+        if (!p->nb_held) return 0;
+        int k = p->rx_seq % BOND_WINDOW;
+        if (p->slot[k].valid && p->slot[k].seq == p->rx_seq) {
+            p->slot[k].valid = 0;
+            p->nb_held--;
+            if (!p->nb_held) p->hold_until = 0;
+            p->rx_seq++;
+            ASSERT(p->slot[k].len <= len);
+            memcpy(buf, p->slot[k].buf, p->slot[k].len);
+            return p->slot[k].len;
+        }
+        if (!p->flush && !expired) return 0;
+        p->rx_seq++; // skip gap
+    }
+}
+
+static ssize_t bond_read(struct bond_port *p, uint8_t *buf, ssize_t len) {
+    ssize_t rlen;
+    if ((rlen = bond_pop(p, buf, len))) return rlen;
+
+    struct epoll_event ev;
+    int n;
+    ASSERT_ERRNO(n = epoll_wait(p->p.fd, &ev, 1, 0));
+    if (!n) return 0;
+    int i = ev.data.u32;
+    struct udp_port *path = p->path[i];
+
+    /* The payload goes to buf, which can be full, so the sequence
+     * number can end up partly or fully in tail. */
+    uint8_t tail[4];
+    struct iovec iov[] = {
+        { .iov_base = buf, .iov_len = len },
+        { .iov_base = tail, .iov_len = 4 },
+    };
+    struct sockaddr_in peer = {};
+    struct msghdr msg = {
+        .msg_name = &peer,
+        .msg_namelen = sizeof(peer),
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+    };
+    rlen = recvmsg(path->p.fd, &msg, MSG_DONTWAIT);
+    if (rlen == -1) {
+        if (errno != EAGAIN) bond_path_error(p, i);
+        return 0;
+    }
+    if (!udp_peer_ok(path, &peer)) return 0;
+    if (rlen < 4 || (msg.msg_flags & MSG_TRUNC)) return 0;
+    rlen -= 4;
+    uint32_t seq = 0;
+    for (ssize_t k=rlen; k<rlen+4; k++) seq = (seq << 8) | (k < len ? buf[k] : tail[k - len]);
+    if (!p->rr) return rlen;
+
+    if (!p->rx_sync) {
+        p->rx_sync = 1;
+        p->rx_seq = seq;
+    }
+    int32_t d = seq - p->rx_seq;
+    if (d < -(1 << 16)) {
+        /* Far behind, assume the sender restarted. */
+        p->rx_seq = seq + 1;
+        return rlen;
+    }
+    if (d < 0) {
+        /* Late, after its gap was skipped. */
+        return rlen;
+    }
+    if (d == 0) {
+        /* Any held packets that follow come out through pop. */
+        p->rx_seq++;
+        return rlen;
+    }
+    if (d < BOND_WINDOW) {
+        int k = seq % BOND_WINDOW;
+        if (p->slot[k].valid) return 0; // duplicate
+        p->slot[k].valid = 1;
+        p->slot[k].seq = seq;
+        p->slot[k].len = rlen;
+        memcpy(p->slot[k].buf, buf, rlen);
+        if (!p->nb_held++) p->hold_until = bond_now() + BOND_HOLD_NS;
+        return 0;
+    }
+    /* Out of window: give up on the gaps. */
+    p->flush = 1;
+    p->overflow_seq = seq;
+    p->overflow_len = rlen;
+    memcpy(p->overflow, buf, rlen);
+    return bond_pop(p, buf, len);
+}
+
+static int bond_timeout(struct bond_port *p) {
+    if (!p->nb_held) return -1;
+    int64_t ns = p->hold_until - bond_now();
+    return ns <= 0 ? 0 : (ns + 999999) / 1000000;
+}
+
+/* "@addr" or "@ifname" after a path binds its socket to a local
+   address or interface, so paths to the same peer can go out over
+   different uplinks.  An address needs routes that pick the uplink by
+   source, e.g. policy routing.  An interface needs CAP_NET_RAW.  port
+   is the port to listen on, 0 for connecting paths. */
+static void bond_path_bind(struct udp_port *path, const char *local, uint16_t port) {
+    int fd = path->p.fd;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    if (1 != inet_pton(AF_INET, local, &addr.sin_addr)) {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        ASSERT_ERRNO(setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, local, strlen(local)));
+    }
+    if (addr.sin_port || addr.sin_addr.s_addr) {
+        ASSERT_ERRNO(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int)));
+        ASSERT_ERRNO(bind(fd, (struct sockaddr *)&addr, sizeof(addr)));
+    }
+    LOG("bond: path %d on %s\n", port, local);
+}
+
+/* Paths are separated by commas, and are either "port" to listen or
+   "host:port" to connect, optionally followed by "@local" and
+   "*weight". */
+struct port *port_open_bond(const char *paths_ro, int mode) {
+    struct bond_port *p;
+    ASSERT(p = malloc(sizeof(*p)));
+    memset(p,0,sizeof(*p));
+    ASSERT_ERRNO(p->p.fd = epoll_create1(0));
+    p->p.fd_out = -1;
+    p->p.read  = (port_read_fn)bond_read;
+    p->p.write = (port_write_fn)bond_write;
+    p->p.pop   = (port_pop_fn)bond_pop;
+    p->p.timeout = (port_timeout_fn)bond_timeout;
+    p->rr = !!(mode & BOND_RR);
+    p->ip = !!(mode & BOND_IP);
+
+    char paths[strlen(paths_ro)+1];
+    strcpy(paths, paths_ro);
+    char *save = NULL;
+    for (char *tok = strtok_r(paths, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        ASSERT(p->nb_paths < BOND_MAX_PATHS);
+        int i = p->nb_paths++;
+        char *star = strchr(tok, '*');
+        p->weight[i] = 1;
+        if (star) {
+            *star = 0;
+            ASSERT((p->weight[i] = atoi(star+1)) > 0);
+        }
+        p->total_weight += p->weight[i];
+        char *at = strchr(tok, '@');
+        if (at) *at = 0;
+        char *colon = strchr(tok, ':');
+        uint16_t listen = colon ? 0 : atoi(tok);
+        if (colon) {
+            *colon = 0;
+            p->path[i] = (void*)port_open_udp_connect(tok, atoi(colon+1));
+        }
+        else {
+            /* With a local address, bind to it instead. */
+            p->path[i] = (void*)port_open_udp(at ? 0 : listen);
+        }
+        if (at) bond_path_bind(p->path[i], at+1, listen);
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+        ASSERT_ERRNO(epoll_ctl(p->p.fd, EPOLL_CTL_ADD, p->path[i]->p.fd, &ev));
+    }
+    ASSERT(p->nb_paths > 0);
+    p->tx_path = -1;
+    LOG("bond: %d paths, %s\n", p->nb_paths,
+        p->rr ? "round robin" : p->ip ? "IP flow hash" : "flow hash");
+    return &p->p;
+}
+
+
+
+
+/***** 1.7. TCP */
+
+/* Stream framing can be followed by "+crc" to enable frame checks,
+ * e.g. "-:4+crc" or "TTY:slip+crc:/dev/ttyUSB0".  This strips the
+ * suffix and returns the port flags. */
+static uint32_t port_spec_flags(char *tok) {
+    char *plus = strchr(tok, '+');
+    if (!plus) return 0;
+    if (strcmp(plus, "+crc")) ERROR("unknown framing option %s\n", plus);
+    *plus = 0;
+    return BUF_PORT_CRC32C;
+}
+static struct port *port_set_flags(struct port *p, uint32_t flags) {
+    ((struct buf_port *)p)->flags |= flags;
+    return p;
+}
+
+/* Open a stream port on a file descriptor, by framing name: "slip",
+ * "hex" or the {packet,N} size, with optional "+crc". */
+struct port *port_open_framed(const char *framing_ro, int fd, int fd_out) {
+    char framing[strlen(framing_ro)+1];
+    strcpy(framing, framing_ro);
+    uint32_t flags = port_spec_flags(framing);
+    if (!strcmp("slip", framing)) {
+        return port_set_flags(port_open_slip_stream(fd, fd_out), flags);
+    }
+    if (!strcmp("hex", framing)) {
+        ASSERT(!flags);
+        return port_open_hex_stream(fd, fd_out);
+    }
+    uint32_t len_bytes = atoi(framing);
+    ASSERT(len_bytes >= 1 && len_bytes <= 4);
+    return port_set_flags(port_open_packetn_stream(len_bytes, fd, fd_out), flags);
+}
+
+/* Serial port with any of the stream framings, see tty_open(). */
+struct port *port_open_tty(const char *framing, const char *dev, const struct tty_opts *o) {
+    int fd = tty_open(dev, o);
+    struct port *p = port_open_framed(framing, fd, fd);
+    if (o && o->outq) {
+        port_set_outq(p, o->outq > 0 ? o->outq : tty_fifo_size(fd), tty_baud(fd));
+        LOG("%s: output queue limit %d bytes at %d baud\n", dev,
+            ((struct buf_port *)p)->outq_max, ((struct buf_port *)p)->baud);
+    }
+    return p;
+}
+void port_set_outq(struct port *p, uint32_t outq_max, uint32_t baud) {
+    struct buf_port *b = (struct buf_port *)p;
+    ASSERT(outq_max && baud && !p->flush);
+    ASSERT(b->hold = malloc(TTY_HOLD_SIZE));
+    b->nb_hold = 0;
+    b->outq_max = outq_max;
+    b->baud = baud;
+    p->timeout = (port_timeout_fn)tty_timeout;
+    p->flush = (port_flush_fn)tty_flush;
+}
+
+/* TCP connections carry one of the stream framings.  Nagle is off, so
+   a frame goes out as soon as it is written.  When a loop step writes
+   more than one frame to a port, the socket is corked after the first
+   one and uncorked by the flush method at the end of the step, so the
+   rest of the batch shares segments.
+
+   Socket buffers are left to the kernel's autotuning unless sizes are
+   given, since setting them disables autotuning.  TCP_NOTSENT_LOWAT
+   limits how much unsent data can queue up in the kernel, which keeps
+   latency down when the link is slower than the input. */
+
+static void tcp_setup(int fd, const struct tcp_opts *o) {
+    ASSERT_ERRNO(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int)));
+    if (!o) return;
+    if (o->sndbuf) {
+        ASSERT_ERRNO(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &o->sndbuf, sizeof(int)));
+    }
+    if (o->rcvbuf) {
+        ASSERT_ERRNO(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &o->rcvbuf, sizeof(int)));
+    }
+    if (o->notsent_lowat) {
+        ASSERT_ERRNO(setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &o->notsent_lowat, sizeof(int)));
+    }
+}
+
+/* Connect to host, or if host is NULL, wait for one connection on
+ * port.  Buffer sizes need to be set before the connection is made
+ * for the window scale to take them into account. */
+struct port *port_open_tcp(const char *host, uint16_t port, const char *framing,
+                           const struct tcp_opts *o) {
+    int fd;
+    ASSERT_ERRNO(fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+    struct sockaddr_in address = {
+        .sin_port = htons(port),
+        .sin_family = AF_INET
+    };
+    if (host) {
+        tcp_setup(fd, o);
+        struct hostent *hp;
+        ASSERT(hp = gethostbyname(host));
+        memcpy((char *)&address.sin_addr,
+               (char *)hp->h_addr_list[0],
+               hp->h_length);
+        ASSERT_ERRNO(connect(fd, (struct sockaddr *)&address, sizeof(address)));
+        LOG("tcp: connected to ");
+        log_addr(&address);
+    }
+    else {
+        int lfd = fd;
+        ASSERT_ERRNO(setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int)));
+        tcp_setup(lfd, o);  // inherited by the accepted socket
+        ASSERT_ERRNO(bind(lfd, (struct sockaddr *)&address, sizeof(address)));
+        ASSERT_ERRNO(listen(lfd, 1));
+        LOG("tcp: listening on port %d\n", port);
+        struct sockaddr_in peer;
+        socklen_t addrlen = sizeof(peer);
+        ASSERT_ERRNO(fd = accept(lfd, (struct sockaddr *)&peer, &addrlen));
+        close(lfd);
+        tcp_setup(fd, o);
+        LOG("tcp: accepted ");
+        log_addr(&peer);
+    }
+    /* A write after the peer reset the connection would raise
+     * SIGPIPE, which kills the process without a word.  Get the error
+     * from the write instead, which is logged. */
+    signal(SIGPIPE, SIG_IGN);
+    struct port *p = port_open_framed(framing, fd, fd);
+    ((struct buf_port *)p)->flags |= BUF_PORT_CORK;
+    p->flush = (port_flush_fn)stream_flush;
+    return p;
+}
+
+
+
+
+/***** 1.8. SHARED MEMORY */
+
+/* Frames between bridge processes on the same host, without syscalls
+   on the fast path.  Each direction is a single producer, single
+   consumer ring of fixed size slots in shared memory.  The producer
+   fills the slot at head and then publishes head, the consumer
+   copies the frame out and publishes tail.  When the ring is full,
+   the frame is dropped, as a UDP socket would.
+
+   The consumer's port fd is an eventfd.  Before the consumer gives up
+   on an empty ring it sets its idle flag and checks once more.  The
+   producer checks the flag after publishing head, so only a frame
+   that finds the consumer idle costs an eventfd write.  Both sides
+   need a full fence between their store and load, otherwise each can
+   miss the other's.
+
+   The first process to open SHM:name listens on an abstract unix
+   socket until the second one connects, and passes it the shared
+   memory and both eventfds.  The socket is closed after that, so the
+   name can be reused, but a peer that goes away is not noticed. */
+
+#define SHM_SLOTS 64  // power of two
+#define SHM_LINE 64
+
+struct shm_ring {
+    uint32_t head __attribute__((aligned(SHM_LINE)));  // producer
+    uint32_t tail __attribute__((aligned(SHM_LINE)));  // consumer
+    uint32_t idle;                                     // consumer
+    struct {
+        uint32_t len;
+        uint8_t data[PACKET_MAX_SIZE];
+    } slot[SHM_SLOTS] __attribute__((aligned(SHM_LINE)));
+};
+struct shm_port {
+    struct port p;       // fd: rx eventfd, fd_out: tx eventfd
+    struct shm_ring *rx;
+    struct shm_ring *tx;
+    uint32_t drops;
+};
+
+static ssize_t shm_pop(struct shm_port *p, uint8_t *buf, ssize_t len) {
+    struct shm_ring *r = p->rx;
+    uint32_t tail = r->tail;
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&r->idle, 1, __ATOMIC_SEQ_CST);
+        if (tail == __atomic_load_n(&r->head, __ATOMIC_SEQ_CST)) return 0;
+        __atomic_store_n(&r->idle, 0, __ATOMIC_RELAXED);
+    }
+    uint32_t n = r->slot[tail % SHM_SLOTS].len;
+    ASSERT(n <= len);
+    memcpy(buf, r->slot[tail % SHM_SLOTS].data, n);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return n;
+}
+static ssize_t shm_read(struct shm_port *p, uint8_t *buf, ssize_t len) {
+    /* Clear the wakeup.  It can be gone already when a previous step
+       ran out of budget and the ring was drained since. */
+    uint64_t count;
+    if (-1 == read(p->p.fd, &count, sizeof(count))) {
+        if (errno != EAGAIN) ASSERT_ERRNO(-1);
+    }
+    __atomic_store_n(&p->rx->idle, 0, __ATOMIC_RELAXED);
+    return shm_pop(p, buf, len);
+}
+static ssize_t shm_write(struct shm_port *p, uint8_t *buf, ssize_t len) {
+    struct shm_ring *r = p->tx;
+    uint32_t head = r->head;
+    ASSERT(len <= PACKET_MAX_SIZE);
+    /* An empty frame would look like an empty ring to pop. */
+    if (len == 0) return 0;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == SHM_SLOTS) {
+        if (!(p->drops++ % 1000)) LOG("shm: ring full, %d dropped\n", p->drops);
+        return 0;
+    }
+    r->slot[head % SHM_SLOTS].len = len;
+    memcpy(r->slot[head % SHM_SLOTS].data, buf, len);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->idle, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        ASSERT_ERRNO(write(p->p.fd_out, &one, sizeof(one)));
+    }
+    return len;
+}
+
+static struct shm_ring *shm_map(int fd) {
+    void *m = mmap(NULL, 2 * sizeof(struct shm_ring),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ASSERT(m != MAP_FAILED);
+    close(fd);
+    return m;
+}
+/* fd[0] is the memory, fd[1] and fd[2] wake up the consumer of ring 0
+   and ring 1.  The creator produces on ring 0. */
+static struct shm_ring *shm_create(int *fd) {
+    char name[32];
+    snprintf(name, sizeof(name), "/packet_bridge-%d", (int)getpid());
+    ASSERT_ERRNO(fd[0] = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600));
+    ASSERT_ERRNO(shm_unlink(name));
+    ASSERT_ERRNO(ftruncate(fd[0], 2 * sizeof(struct shm_ring)));
+    ASSERT_ERRNO(fd[1] = eventfd(0, EFD_NONBLOCK));
+    ASSERT_ERRNO(fd[2] = eventfd(0, EFD_NONBLOCK));
+    int mfd;
+    ASSERT_ERRNO(mfd = dup(fd[0]));
+    struct shm_ring *ring = shm_map(mfd);
+    /* Nobody has looked at the rings yet, so wake up on the first
+       frame. */
+    ring[0].idle = ring[1].idle = 1;
+    return ring;
+}
+static void shm_send_fds(int s, int *fd, int nb_fds) {
+    union { struct cmsghdr h; char buf[CMSG_SPACE(3 * sizeof(int))]; } c;
+    uint8_t byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = c.buf, .msg_controllen = CMSG_SPACE(nb_fds * sizeof(int))
+    };
+    struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+    h->cmsg_level = SOL_SOCKET;
+    h->cmsg_type = SCM_RIGHTS;
+    h->cmsg_len = CMSG_LEN(nb_fds * sizeof(int));
+    memcpy(CMSG_DATA(h), fd, nb_fds * sizeof(int));
+    ASSERT_ERRNO(sendmsg(s, &msg, 0));
+}
+static void shm_recv_fds(int s, int *fd, int nb_fds) {
+    union { struct cmsghdr h; char buf[CMSG_SPACE(3 * sizeof(int))]; } c;
+    uint8_t byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = c.buf, .msg_controllen = sizeof(c.buf)
+    };
+    ssize_t rv;
+    ASSERT_ERRNO(rv = recvmsg(s, &msg, 0));
+    struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+    ASSERT(rv == 1 && h && h->cmsg_type == SCM_RIGHTS);
+    ASSERT(h->cmsg_len == CMSG_LEN(nb_fds * sizeof(int)));
+    memcpy(fd, CMSG_DATA(h), nb_fds * sizeof(int));
+}
+
+struct port *port_open_shm(const char *name) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int n = snprintf(&addr.sun_path[1], sizeof(addr.sun_path) - 1, "packet_bridge/%s", name);
+    ASSERT(n < sizeof(addr.sun_path) - 1);
+    socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + n;
+
+    struct shm_ring *ring;
+    int fd[3];
+    int side;
+    for(;;) {
+        int s;
+        ASSERT_ERRNO(s = socket(AF_UNIX, SOCK_STREAM, 0));
+        if (!connect(s, (struct sockaddr *)&addr, addrlen)) {
+            shm_recv_fds(s, fd, 3);
+            close(s);
+            ring = shm_map(fd[0]);
+            side = 1;
+            break;
+        }
+        if (errno != ECONNREFUSED) ASSERT_ERRNO(-1);
+        if (!bind(s, (struct sockaddr *)&addr, addrlen)) {
+            ASSERT_ERRNO(listen(s, 1));
+            LOG("shm: %s: waiting for peer\n", name);
+            ring = shm_create(fd);
+            int c;
+            ASSERT_ERRNO(c = accept(s, NULL, NULL));
+            shm_send_fds(c, fd, 3);
+            close(c);
+            close(s);
+            close(fd[0]);
+            side = 0;
+            break;
+        }
+        if (errno != EADDRINUSE) ASSERT_ERRNO(-1);
+        /* The other side got there first, but is not listening yet. */
+        close(s);
+    }
+    LOG("shm: %s: connected\n", name);
+
+    struct shm_port *p;
+    ASSERT(p = malloc(sizeof(*p)));
+    memset(p,0,sizeof(*p));
+    p->tx = &ring[side];
+    p->rx = &ring[!side];
+    p->p.fd     = fd[1 + !side];
+    p->p.fd_out = fd[1 + side];
+    p->p.read  = (port_read_fn)shm_read;
+    p->p.write = (port_write_fn)shm_write;
+    p->p.pop   = (port_pop_fn)shm_pop;
+    return &p->p;
+}
+
+
+
+
+/***** 2. PACKET HANDLER */
+
+/* Default behavior for the stand-alone program is to just forward a
+ * packet to the other port.  Any other processing behavior is left to
+ * application code that uses packet_bridge as a library.. */
+
+void packet_forward(struct packet_handle_ctx *x, int from, const uint8_t *buf, ssize_t len) {
+    int to = (from == 0) ? 1 : 0;
+    x->port[to]->write(x->port[to], buf, len);
+}
+
+
+/***** 2.1. FAN-OUT */
+
+/* Sending the same packet to many ports would re-encode it for each
+ * stream port.  Instead, encode once per distinct framing into a
+ * reference counted buffer that is shared by all ports using that
+ * framing. */
+
+struct packet_buf *packet_buf_new(uint32_t size) {
+    struct packet_buf *b;
+    ASSERT(b = malloc(sizeof(*b) + size));
+    b->refs = 1;
+    b->len = 0;
+    return b;
+}
+struct packet_buf *packet_buf_ref(struct packet_buf *b) {
+    b->refs++;
+    return b;
+}
+void packet_buf_unref(struct packet_buf *b) {
+    ASSERT(b->refs > 0);
+    if (!--b->refs) free(b);
+}
+
+/* All ports write synchronously, and a tty port copies what it
+ * holds, so the reference is released when the write is done.  A
+ * port that queues output would keep it. */
+void port_write_encoded(struct port *p, struct packet_buf *b) {
+    stream_write((struct buf_port *)p, b->data, b->len);
+    packet_buf_unref(b);
+}
+
+/* Only ports with an encode method are buffered ports, so check that
+ * before looking at the flags. */
+static int port_same_framing(struct port *a, struct port *b) {
+    if (!a->encode || a->encode != b->encode || a->framing != b->framing) return 0;
+    uint32_t fa = ((struct buf_port *)a)->flags & BUF_PORT_CRC32C;
+    uint32_t fb = ((struct buf_port *)b)->flags & BUF_PORT_CRC32C;
+    return fa == fb;
+}
+
+void packet_fanout(struct packet_handle_ctx *x, const int *to, int nb_to,
+                   const uint8_t *buf, ssize_t len) {
+    struct { struct port *port; struct packet_buf *b; } enc[nb_to];
+    int nb_enc = 0;
+    for (int i=0; i<nb_to; i++) {
+        struct port *p = x->port[to[i]];
+        if (!p->encode) {
+            /* Datagram ports don't encode. */
+            p->write(p, buf, len);
+            continue;
+        }
+        struct packet_buf *b = NULL;
+        for (int e=0; e<nb_enc; e++) {
+            if (port_same_framing(enc[e].port, p)) { b = enc[e].b; break; }
+        }
+        if (!b) {
+            b = packet_buf_new(PORT_ENCODE_MAX(len));
+            b->len = p->encode(p, b->data, buf, len);
+            enc[nb_enc].port = p;
+            enc[nb_enc].b = b;
+            nb_enc++;
+        }
+        port_write_encoded(p, packet_buf_ref(b));
+    }
+    for (int e=0; e<nb_enc; e++) {
+        packet_buf_unref(enc[e].b);
+    }
+}
+
+/* Send to all ports except the source. */
+void packet_flood(struct packet_handle_ctx *x, int from, const uint8_t *buf, ssize_t len) {
+    int to[x->nb_ports];
+    int nb_to = 0;
+    for (int i=0; i<x->nb_ports; i++) {
+        if (i != from) to[nb_to++] = i;
+    }
+    packet_fanout(x, to, nb_to, buf, len);
+}
+
+
+
+
+
+
+/***** 2.2. ROUTING */
+
+/* IPv4 and IPv6 routing on destination address, for TUN ports.
+
+   The table is a multibit trie with 8 bit strides, using controlled
+   prefix expansion: a prefix that ends inside a stride is written to
+   all the entries it covers, unless an entry already holds a longer
+   prefix.  Prefixes are also pushed down to the leaves of the nodes
+   below the entries they cover, so a lookup follows children until
+   an entry has none, and its leaf is the longest match.  That is at
+   most 4 node visits for IPv4 and 16 for IPv6, and no backtracking.
+
+   Nodes are compressed as in poptrie.  A node doesn't store its 256
+   entries, but a bitmap of the entries that have a child and one of
+   the entries that start a new run of equal leaves.  Children and
+   leaves are kept in arrays in entry order, so an entry's index into
+   them is the number of bits set in the bitmap before it.  Leaves
+   mostly come in long runs, so a node on the path to a single long
+   prefix takes about 100 bytes instead of 2k. */
+
+struct route_leaf {
+    int16_t port;    // next hop, -1 if none
+    uint8_t plen;    // prefix length of next hop
+};
+struct route_node {
+    uint64_t child_map[4];   // entries that have a child
+    struct route_node *child;
+    uint8_t child_rank[4];   // bits set in child_map words before
+    uint8_t leaf_rank[4];    // bits set in leaf_map words before
+    uint64_t leaf_map[4];    // entries that start a run of leaves
+    struct route_leaf *leaf;
+};
+struct route_table {
+    struct route_node root[2];  // IPv4, IPv6
+    int max_port;               // highest next hop, -1 if none
+};
+
+/* Bits set in map before entry i, and in i itself if incl. */
+static inline int route_rank(const uint64_t *map, const uint8_t *rank, int i, int incl) {
+    uint64_t mask = (incl ? 2ULL << (i & 63) : 1ULL << (i & 63)) - 1;
+    return rank[i >> 6] + __builtin_popcountll(map[i >> 6] & mask);
+}
+static inline int route_bit(const uint64_t *map, int i) {
+    return (map[i >> 6] >> (i & 63)) & 1;
+}
+static void route_ranks(const uint64_t *map, uint8_t *rank) {
+    rank[0] = 0;
+    for (int w=1; w<4; w++) rank[w] = rank[w-1] + __builtin_popcountll(map[w-1]);
+}
+
+static void route_node_init(struct route_node *n, struct route_leaf leaf) {
+    memset(n,0,sizeof(*n));
+    ASSERT(n->leaf = malloc(sizeof(*n->leaf)));
+    n->leaf[0] = leaf;
+    n->leaf_map[0] = 1;
+    route_ranks(n->leaf_map, n->leaf_rank);
+}
+
+static inline const struct route_leaf *route_leaf(const struct route_node *n, int i) {
+    return &n->leaf[route_rank(n->leaf_map, n->leaf_rank, i, 1) - 1];
+}
+
+/* Child of entry i, added if it doesn't exist yet.  A new child
+ * starts out with the entry's leaf. */
+static struct route_node *route_child(struct route_node *n, int i) {
+    int r = route_rank(n->child_map, n->child_rank, i, 0);
+    if (!route_bit(n->child_map, i)) {
+        int nb = route_rank(n->child_map, n->child_rank, 255, 1);
+        ASSERT(n->child = realloc(n->child, (nb + 1) * sizeof(*n->child)));
+        memmove(&n->child[r+1], &n->child[r], (nb - r) * sizeof(*n->child));
+        route_node_init(&n->child[r], *route_leaf(n, i));
+        n->child_map[i >> 6] |= 1ULL << (i & 63);
+        route_ranks(n->child_map, n->child_rank);
+    }
+    return &n->child[r];
+}
+
+/* Leaves are updated in expanded form, then compressed again. */
+static void route_leaves_get(const struct route_node *n, struct route_leaf *e) {
+    for (int i=0, l=-1; i<256; i++) {
+        l += route_bit(n->leaf_map, i);
+        e[i] = n->leaf[l];
+    }
+}
+static void route_leaves_set(struct route_node *n, const struct route_leaf *e) {
+    int nb = 0;
+    memset(n->leaf_map,0,sizeof(n->leaf_map));
+    for (int i=0; i<256; i++) {
+        if (!i || e[i].port != e[i-1].port || e[i].plen != e[i-1].plen) {
+            n->leaf_map[i >> 6] |= 1ULL << (i & 63);
+            nb++;
+        }
+    }
+    ASSERT(n->leaf = realloc(n->leaf, nb * sizeof(*n->leaf)));
+    for (int i=0, l=-1; i<256; i++) {
+        if (route_bit(n->leaf_map, i)) n->leaf[++l] = e[i];
+    }
+    route_ranks(n->leaf_map, n->leaf_rank);
+}
+
+/* Set a next hop on entries lo..hi-1 and everything below them,
+ * except where a longer prefix is set already. */
+static void route_push(struct route_node *n, int lo, int hi, int port, int plen) {
+    struct route_leaf e[256];
+    route_leaves_get(n, e);
+    for (int i=lo; i<hi; i++) {
+        if (e[i].port < 0 || e[i].plen <= plen) {
+            e[i].port = port;
+            e[i].plen = plen;
+        }
+        if (route_bit(n->child_map, i)) {
+            route_push(&n->child[route_rank(n->child_map, n->child_rank, i, 0)], 0, 256, port, plen);
+        }
+    }
+    route_leaves_set(n, e);
+}
+
+struct route_table *route_table_new(void) {
+    struct route_table *t;
+    ASSERT(t = malloc(sizeof(*t)));
+    struct route_leaf none = { .port = -1 };
+    route_node_init(&t->root[0], none);
+    route_node_init(&t->root[1], none);
+    t->max_port = -1;
+    return t;
+}
+
+void route_add(struct route_table *t, const uint8_t *addr, int addr_len,
+               int plen, int port) {
+    ASSERT(addr_len == 4 || addr_len == 16);
+    ASSERT(plen >= 0 && plen <= 8 * addr_len);
+    ASSERT(port >= 0 && port < 0x7FFF);
+    if (port > t->max_port) t->max_port = port;
+    struct route_node *n = &t->root[addr_len == 16];
+    int depth = 0;
+    for (; plen > 8 * (depth + 1); depth++) {
+        n = route_child(n, addr[depth]);
+    }
+    /* Expand to all entries covered by the remaining bits. */
+    int span = 1 << (8 * (depth + 1) - plen);
+    int base = addr[depth] & ~(span - 1);
+    route_push(n, base, base + span, port, plen);
+}
+
+/* The popcounts need the CPU's instruction to be fast, which the
+ * default build can't assume, so pick a lookup the way crc32c() does. */
+static inline __attribute__((always_inline))
+int route_lookup_inline(const struct route_table *t, const uint8_t *addr, int addr_len) {
+    const struct route_node *n = &t->root[addr_len == 16];
+    for (int i=0; i<addr_len; i++) {
+        int a = addr[i];
+        if (!route_bit(n->child_map, a)) return route_leaf(n, a)->port;
+        n = &n->child[route_rank(n->child_map, n->child_rank, a, 0)];
+    }
+    return -1;
+}
+static int route_lookup_sw(const struct route_table *t, const uint8_t *addr, int addr_len) {
+    return route_lookup_inline(t, addr, addr_len);
+}
+#ifdef HAVE_POPCNT
+__attribute__((target("popcnt")))
+static int route_lookup_hw(const struct route_table *t, const uint8_t *addr, int addr_len) {
+    return route_lookup_inline(t, addr, addr_len);
+}
+#endif
+int route_lookup(const struct route_table *t, const uint8_t *addr, int addr_len) {
+    static int (*fn)(const struct route_table *, const uint8_t *, int);
+    if (!fn) {
+        fn = route_lookup_sw;
+#ifdef HAVE_POPCNT
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("popcnt")) fn = route_lookup_hw;
+#endif
+    }
+    return fn(t, addr, addr_len);
+}
+
+/* Parse "<prefix>/<len>=<port>", e.g. "10.1.0.0/16=2" or
+ * "fd00::/8=1".  Returns 0 if spec is not a route, which can't be
+ * told from '/' or '=' alone, since port specs contain those too,
+ * e.g. "TTY:slip:/dev/ttyUSB0:outq=fifo".  A spec that starts with
+ * an address but has a bad length or port is an error. */
+int route_parse(struct route_table *t, const char *spec_ro) {
+    char spec[strlen(spec_ro)+1];
+    strcpy(spec, spec_ro);
+    char *slash, *eq;
+    if (!(slash = strchr(spec, '/'))) return 0;
+    if (!(eq = strchr(slash, '='))) return 0;
+    *slash = 0;
+    *eq = 0;
+    uint8_t addr[16];
+    int addr_len = strchr(spec, ':') ? 16 : 4;
+    if (1 != inet_pton(addr_len == 4 ? AF_INET : AF_INET6, spec, addr)) return 0;
+    char *end;
+    long plen = strtol(slash+1, &end, 10);
+    if (end == slash+1 || *end || plen < 0 || plen > 8 * addr_len) {
+        ERROR("bad prefix length in route %s\n", spec_ro);
+    }
+    long port = strtol(eq+1, &end, 10);
+    if (end == eq+1 || *end || port < 0 || port >= 0x7FFF) {
+        ERROR("bad port in route %s\n", spec_ro);
+    }
+    route_add(t, addr, addr_len, plen, port);
+    return 1;
+}
+
+/* Handler for routing IP packets, with ctx->priv pointing to the
+ * route table.  Packets without a route, or with a route back to
+ * where they came from, are dropped. */
+void packet_route(struct packet_handle_ctx *x, int from, const uint8_t *buf, ssize_t len) {
+    const struct route_table *t = x->priv;
+    int to = -1;
+    if (len >= 20 && (buf[0] >> 4) == 4) {
+        to = route_lookup(t, &buf[16], 4);
+    }
+    else if (len >= 40 && (buf[0] >> 4) == 6) {
+        to = route_lookup(t, &buf[24], 16);
+    }
+    if (to < 0 || to == from || to >= x->nb_ports) return;
+    x->port[to]->write(x->port[to], buf, len);
+}
+
+
+
+
+/***** 3. FRAMEWORK */
+
+/* The loop is split up so it can be embedded in another event loop,
+ * e.g. epoll or libuv.  Typical use:
+ *
+ *   struct pollfd pfd[ctx->nb_ports];
+ *   packet_loop_pollfds(ctx, pfd);
+ *   ... add pfd[i].fd with pfd[i].events to the host loop ...
+ *   ... on readiness: set pfd[i].revents, call packet_loop_step()
+ *   ... poll again no later than packet_loop_timeout(ctx)
+ */
+
+void packet_loop_pollfds(struct packet_handle_ctx *ctx, struct pollfd *pfd) {
+    for (int i=0; i<ctx->nb_ports; i++) {
+        pfd[i].fd = ctx->port[i]->fd;
+        pfd[i].events = POLLERR | POLLIN;
+        pfd[i].revents = 0;
+    }
+}
+
+int packet_loop_timeout(struct packet_handle_ctx *ctx) {
+    int timeout = ctx->timeout;
+    for (int i=0; i<ctx->nb_ports; i++) {
+        struct port *p = ctx->port[i];
+        if (p->pending) return 0;
+        if (!p->timeout) continue;
+        int t = p->timeout(p);
+        if (t >= 0 && (timeout < 0 || t < timeout)) timeout = t;
+    }
+    return timeout;
+}
+
+int packet_loop_step(packet_handle_fn handle,
+                     struct packet_handle_ctx *ctx,
+                     const struct pollfd *pfd, int budget) {
+    uint8_t buf[PACKET_MAX_SIZE]; // FIXME: Make this configurable
+    int count = 0;
+    if (!pfd) {
+        struct pollfd poll_pfd[ctx->nb_ports];
+        packet_loop_pollfds(ctx, poll_pfd);
+        ASSERT_ERRNO(poll(&poll_pfd[0], ctx->nb_ports, 0));
+        return packet_loop_step(handle, ctx, poll_pfd, budget);
+    }
+    for (int i=0; i<ctx->nb_ports; i++) {
+        ctx->port[i]->batch = 1;
+    }
+    /* Start at a different port each time so a budget doesn't starve
+     * the last ports. */
+    for (int n=0; n<ctx->nb_ports; n++) {
+        int i = (ctx->next + n) % ctx->nb_ports;
+        struct port *in  = ctx->port[i];
+        if (budget > 0 && count >= budget) break;
+        /* Hangup and error are handled by read(), so they are not
+         * reported over and over. */
+        int ready = pfd[i].revents & (POLLIN | POLLHUP | POLLERR);
+        int due = in->timeout && !in->timeout(in);
+        if (!ready && !in->pending && !due) continue;
+        in->pending = 0;
+
+        /* The read calls the underlying OS read method only once, so
+         * we are guaranteed to not block.  Buffered ports return a
+         * pending packet before reading.  A port that is only pending
+         * or due may have nothing left and an fd that blocks, so
+         * don't read then. */
+        int rlen = ready ? in->read(in, buf, sizeof(buf))
+                         : in->pop((struct buf_port *)in, buf, sizeof(buf));
+        if (rlen) {
+            handle(ctx, i, buf, rlen);
+            count++;
+        }
+        else {
+            /* Port handler read data but dropped it. */
+        }
+
+        /* For streaming ports, it is possible that the OS read method
+         * returned multiple packets, so we pop them one by one.  If
+         * the budget runs out, the rest is handled on the next
+         * step. */
+        if (in->pop) {
+            for(;;) {
+                if (budget > 0 && count >= budget) {
+                    in->pending = 1;
+                    break;
+                }
+                if (!(rlen = in->pop((struct buf_port *)in, buf, sizeof(buf)))) break;
+                handle(ctx, i, buf, rlen);
+                count++;
+            }
+        }
+    }
+    for (int i=0; i<ctx->nb_ports; i++) {
+        struct port *p = ctx->port[i];
+        if (p->flush) p->flush(p);
+        p->batch = 0;
+    }
+    ctx->next = (ctx->next + 1) % ctx->nb_ports;
+    ctx->frames += count;
+    return count;
+}
+
+/* Cut-through forwarding between two {packet,N} streams with the
+ * same framing.  Frames don't need to be decoded and encoded again:
+ * read a chunk, walk the length prefixes to find the end of the last
+ * complete frame, and write everything up to there with one call.
+ * The partial frame at the end stays in the buffer.  Not used with
+ * frame checks, since those need to be verified on the way.
+ *
+ * splice() could avoid the copy through user space, but then the
+ * length prefixes can't be seen without an extra read per frame, and
+ * ttys don't support it anyway. */
+
+int packet_cut_through_ok(struct port *a, struct port *b) {
+    return a->encode == (port_encode_fn)packetn_encode
+        && port_same_framing(a, b)
+        && !(((struct buf_port *)a)->flags & BUF_PORT_CRC32C);
+}
+
+/* Returns the number of complete frames forwarded. */
+static uint32_t cut_through(struct packetn_port *in, struct port *out) {
+    struct buf_port *b = &in->p;
+    uint32_t room;
+    uint8_t *tail = buf_port_reserve(b, &room);
+    ssize_t rv = read(b->p.fd, tail, room);
+    if (rv == -1 && errno == EAGAIN) return 0;
+    ASSERT_ERRNO(rv);
+    if (rv == 0) ERROR("eof");
+    b->count += rv;
+
+    uint32_t end = b->head, frames = 0;
+    for(;;) {
+        if (b->count - end < in->len_bytes) break;
+        uint32_t size = 0;
+        for (uint32_t i=0; i<in->len_bytes; i++) {
+            size = (size << 8) + b->buf[end + i];
+        }
+        if (PACKET_MAX_SIZE < size) {
+            ERROR("buffer overflow for stream packet size=%d\n", size);
+        }
+        if (b->count - end < in->len_bytes + size) break;
+        end += in->len_bytes + size;
+        frames++;
+    }
+    if (end > b->head) {
+        struct buf_port *bo = (struct buf_port *)out;
+        if (bo->outq_max) tty_wait_outq(bo);
+        assert_write(out->fd_out, &b->buf[b->head], end - b->head);
+        b->head = end;
+    }
+    return frames;
+}
+
+void packet_cut_through(struct packet_handle_ctx *ctx) {
+    ASSERT(ctx->nb_ports == 2);
+    ASSERT(packet_cut_through_ok(ctx->port[0], ctx->port[1]));
+    LOG("cut-through\n");
+    struct pollfd pfd[2];
+    packet_loop_pollfds(ctx, pfd);
+    for(;;) {
+        ASSERT_ERRNO(poll(&pfd[0], 2, ctx->timeout));
+        for (int i=0; i<2; i++) {
+            if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ctx->frames += cut_through((void*)ctx->port[i], ctx->port[!i]);
+            }
+        }
+    }
+}
+
+void packet_loop(packet_handle_fn handle,
+                 struct packet_handle_ctx *ctx) {
+    struct pollfd pfd[ctx->nb_ports];
+    packet_loop_pollfds(ctx, pfd);
+    for(;;) {
+        ASSERT_ERRNO(poll(&pfd[0], ctx->nb_ports, packet_loop_timeout(ctx)));
+        packet_loop_step(handle, ctx, pfd, 0);
     }
 }
 
@@ -650,6 +2221,13 @@ struct port *port_open(const char *spec_ro) {
         return port_open_tap(tapdev);
     }
 
+    if (!strcmp(tok, "TUN")) {
+        ASSERT(tok = strtok(NULL, delim));
+        const char *tundev = tok;
+        ASSERT(NULL == (tok = strtok(NULL, delim)));
+        return port_open_tun(tundev);
+    }
+
     if (!strcmp(tok, "UDP-LISTEN")) {
         ASSERT(tok = strtok(NULL, delim));
         uint16_t port = atoi(tok);
@@ -665,64 +2243,68 @@ struct port *port_open(const char *spec_ro) {
         uint16_t port = atoi(tok);
         ASSERT(NULL == (tok = strtok(NULL, delim)));
         //LOG("UDP-LISTEN:%s:%d\n", host, port);
+        return port_open_udp_connect(host, port);
+    }
 
-        struct port *p = port_open_udp(0); // don't spec port here
-        struct udp_port *up = (void*)p;
-
-        struct hostent *hp;
-        ASSERT(hp = gethostbyname(host));
-        memcpy((char *)&up->peer.sin_addr,
-               (char *)hp->h_addr_list[0],
-               hp->h_length);
-        up->peer.sin_port = htons(port);
-        up->peer.sin_family = AF_INET;
-
-        // FIXME: Send some meaningful ethernet packet instead
-        // FIXME: Make this optional?  Or require application to initiate?
-#if 0
-        uint8_t buf[] = {
-            0x55,0x55,0x55,0x55,0x55,0x55,
-            0x55,0x55,0x55,0x55,0x55,0x55,
-            0x55,0x55
-        };
-        LOG("udp: hello to ");
-        log_addr(&up->peer);
-        ASSERT(sizeof(buf) == p->write(p, buf, sizeof(buf)));
-#else
-        LOG("udp: not sending hello\n");
-#endif
-        return p;
+    if (!strcmp(tok, "BOND") || !strcmp(tok, "BOND-RR") || !strcmp(tok, "BOND-IP")) {
+        /* Paths contain colons, so take the rest of the spec. */
+        const char *paths = spec_ro + strlen(tok) + 1;
+        ASSERT(strlen(spec_ro) > strlen(tok));
+        int mode = !strcmp(tok, "BOND-RR") ? BOND_RR : !strcmp(tok, "BOND-IP") ? BOND_IP : 0;
+        return port_open_bond(paths, mode);
     }
 
     if (!strcmp(tok, "TTY")) {
         ASSERT(tok = strtok(NULL, delim));
-        if (!strcmp("slip", tok)) {
-            ASSERT(tok = strtok(NULL, delim));
-            const char *dev = tok;
-            ASSERT(NULL == (tok = strtok(NULL, delim)));
-            LOG("port_open_slip_tty(%s)\n", dev);
-            return port_open_slip_tty(dev);
-        }
-        else {
-            uint16_t len_bytes = atoi(tok);
-            ASSERT(tok = strtok(NULL, delim));
-            const char *dev = tok;
-            ASSERT(NULL == (tok = strtok(NULL, delim)));
-            return port_open_packetn_tty(len_bytes, dev);
+        const char *framing = tok;
+        ASSERT(tok = strtok(NULL, delim));
+        const char *dev = tok;
+        /* Optional baud rate and serial options. */
+        struct tty_opts o = {};
+        while ((tok = strtok(NULL, delim))) {
+            if      (!strcmp(tok, "rtscts"))    o.rtscts = 1;
+            else if (!strcmp(tok, "lowlat"))    o.low_latency = 1;
+            else if (!strcmp(tok, "outq=fifo")) o.outq = -1;
+            else if (!strncmp(tok, "outq=", 5)) ASSERT((o.outq = atoi(tok+5)) > 0);
+            else ASSERT((o.baud = atoi(tok)) > 0);
         }
+        LOG("port_open_tty(%s, %s)\n", framing, dev);
+        return port_open_tty(framing, dev, &o);
     }
 
     if (!strcmp(tok, "-")) {
         ASSERT(tok = strtok(NULL, delim));
-        if (!strcmp("slip", tok)) {
-            ASSERT(NULL == (tok = strtok(NULL, delim)));
-            return port_open_slip_stream(0, 1);
+        const char *framing = tok;
+        ASSERT(NULL == (tok = strtok(NULL, delim)));
+        return port_open_framed(framing, 0, 1);
+    }
+
+    if (!strcmp(tok, "SHM")) {
+        ASSERT(tok = strtok(NULL, delim));
+        return port_open_shm(tok);
+    }
+
+    if (!strcmp(tok, "TCP") || !strcmp(tok, "TCP-LISTEN")) {
+        const char *host = NULL;
+        if (!strcmp(tok, "TCP")) {
+            ASSERT(host = strtok(NULL, delim));
         }
-        else {
-            uint16_t len_bytes = atoi(tok);
-            ASSERT(NULL == (tok = strtok(NULL, delim)));
-            return port_open_packetn_stream(len_bytes, 0, 1);
+        ASSERT(tok = strtok(NULL, delim));
+        uint16_t port = atoi(tok);
+        /* Optional framing, default {packet,4}, and socket options. */
+        const char *framing = "4";
+        struct tcp_opts o = {};
+        while ((tok = strtok(NULL, delim))) {
+            char *eq = strchr(tok, '=');
+            if (!eq) { framing = tok; continue; }
+            *eq = 0;
+            int val = atoi(eq+1);
+            if      (!strcmp(tok, "sndbuf")) o.sndbuf = val;
+            else if (!strcmp(tok, "rcvbuf")) o.rcvbuf = val;
+            else if (!strcmp(tok, "lowat"))  o.notsent_lowat = val;
+            else ERROR("unknown tcp option %s\n", tok);
         }
+        return port_open_tcp(host, port, framing, &o);
     }
 
     if (!strcmp(tok, "HEX")) {
@@ -735,17 +2317,54 @@ struct port *port_open(const char *spec_ro) {
     ERROR("unknown type %s\n", tok);
 }
 
+/* With more than two ports, behave as a hub. */
 int packet_forward_main(int argc, char **argv) {
     ASSERT(argc > 2);
-    struct port *port[2];
+    int nb_ports = argc - 1;
+    struct port *port[nb_ports];
     struct packet_handle_ctx ctx = {
-        .nb_ports = 2,
+        .nb_ports = nb_ports,
         .port = port,
         .timeout = -1 // infinity
     };
-    ASSERT(port[0] = port_open(argv[1]));
-    ASSERT(port[1] = port_open(argv[2]));
-    packet_loop(packet_forward, &ctx);
+    for (int i=0; i<nb_ports; i++) {
+        ASSERT(port[i] = port_open(argv[i+1]));
+    }
+    if (nb_ports == 2 && packet_cut_through_ok(port[0], port[1])) {
+        packet_cut_through(&ctx);
+    }
+    packet_loop(nb_ports == 2 ? packet_forward : packet_flood, &ctx);
+}
+
+
+
+/* Arguments are port specs and routes, e.g.
+
+   packet_route.elf TUN:tun0 TUN:tun1 UDP-LISTEN:1234 \
+       10.1.0.0/16=1 10.2.0.0/16=2 0.0.0.0/0=0
+
+   Route ports are numbered in the order the ports are given. */
+int packet_route_main(int argc, char **argv) {
+    struct port *port[argc];
+    struct route_table *routes = route_table_new();
+    struct packet_handle_ctx ctx = {
+        .nb_ports = 0,
+        .port = port,
+        .timeout = -1, // infinity
+        .priv = routes
+    };
+    for (int i=1; i<argc; i++) {
+        if (!route_parse(routes, argv[i])) {
+            ASSERT(port[ctx.nb_ports++] = port_open(argv[i]));
+        }
+    }
+    ASSERT(ctx.nb_ports > 0);
+    if (routes->max_port >= ctx.nb_ports) {
+        ERROR("route to port %d, but there are only %d ports\n",
+              routes->max_port, ctx.nb_ports);
+    }
+    packet_loop(packet_route, &ctx);
+    return 0;
 }
 
 
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <poll.h>
 
 // Port read/write access and instantiation is abstract
 struct port;
@@ -10,6 +11,9 @@ struct buf_port;
 typedef ssize_t (*port_read_fn)(struct port *, uint8_t *, ssize_t);
 typedef ssize_t (*port_write_fn)(struct port *, const uint8_t *, ssize_t);
 typedef ssize_t (*port_pop_fn)(struct buf_port *p, uint8_t *buf, ssize_t len);
+typedef ssize_t (*port_encode_fn)(struct port *, uint8_t *out, const uint8_t *buf, ssize_t len);
+typedef void (*port_flush_fn)(struct port *);
+typedef int (*port_timeout_fn)(struct port *);
 
 struct port {
     int fd;              // main file descriptor
@@ -17,14 +21,52 @@ struct port {
     port_read_fn read;
     port_write_fn write;
     port_pop_fn pop;     // only for buffered ports
+    port_encode_fn encode; // only for stream ports, see packet_fanout()
+    uint32_t framing;    // encoder parameter, e.g. {packet,N} size
+    int pending;         // buffered packets left, see packet_loop_step()
+    port_flush_fn flush; // optional, called after each loop step
+    int batch;           // set during a loop step, writes may wait for flush
+    port_timeout_fn timeout; // optional, ms until a step is due without input, -1 for none
 };
 struct port *port_open_tap(const char *dev);
+struct port *port_open_tun(const char *dev);
 struct port *port_open_udp(uint16_t port);
+struct port *port_open_udp_connect(const char *host, uint16_t port);
+#define BOND_RR 1 // weighted round robin instead of flow hash
+#define BOND_IP 2 // flow hash on IP packets, e.g. from TUN, not Ethernet
+struct port *port_open_bond(const char *paths, int mode);
 struct port *port_open_packetn_stream(uint32_t len_bytes, int fd, int fd_out);
 struct port *port_open_packetn_tty(uint32_t len_bytes, const char *dev);
 struct port *port_open_slip_stream(int fd, int fd_out);
 struct port *port_open_slip_tty(const char *dev);
 struct port *port_open_hex_stream(int fd, int fd_out);
+struct port *port_open_framed(const char *framing, int fd, int fd_out);
+struct tcp_opts {
+    int sndbuf;          // 0 for kernel default
+    int rcvbuf;
+    int notsent_lowat;
+};
+// Ignores SIGPIPE for the process, so a reset connection fails the
+// write instead.
+struct port *port_open_tcp(const char *host, uint16_t port, const char *framing,
+                           const struct tcp_opts *o);
+struct tty_opts {
+    uint32_t baud;       // 0 to leave as is
+    int rtscts;
+    int low_latency;
+    int outq;            // output queue limit, -1 for FIFO size, 0 for none
+};
+int tty_open(const char *dev, const struct tty_opts *o);
+struct port *port_open_tty(const char *framing, const char *dev, const struct tty_opts *o);
+// Hold output of a stream port while more than outq_max bytes are
+// queued in the driver (TIOCOUTQ, which also works on sockets).
+// Writes don't block: the port's timeout method says when the queue
+// will have drained at the given baud rate, and its flush method
+// writes the held frames from the next loop step.  Frames that don't
+// fit in the hold buffer are dropped.  Set by port_open_tty() for the
+// outq option.
+void port_set_outq(struct port *p, uint32_t outq_max, uint32_t baud);
+struct port *port_open_shm(const char *name);
 struct port *port_open(const char *spec);
 
 
@@ -34,10 +76,31 @@ struct packet_handle_ctx {
     int nb_ports;
     struct port **port;
     int timeout;
+    int next;            // first port to service in the next step
+    void *priv;          // handler data
+    uint64_t frames;     // number of frames handled
 };
 typedef void (*packet_handle_fn)(struct packet_handle_ctx *, int src, const uint8_t *, ssize_t);
 void packet_loop(packet_handle_fn forward, struct packet_handle_ctx *ctx);
 
+// Non-blocking interface, to run the loop from a host event loop.
+// packet_loop_pollfds() fills in one pollfd per port.  After polling,
+// packet_loop_step() handles the ports that are ready, at most budget
+// packets (0 means no limit), and returns the number handled.  If pfd
+// is NULL it polls itself with a 0 timeout.  packet_loop_timeout()
+// returns the timeout for the next poll: 0 if there are buffered
+// packets left over, else the earliest of ctx->timeout and the
+// ports' own timeouts, e.g. for packets held for reordering.
+void packet_loop_pollfds(struct packet_handle_ctx *ctx, struct pollfd *pfd);
+int packet_loop_step(packet_handle_fn handle, struct packet_handle_ctx *ctx,
+                     const struct pollfd *pfd, int budget);
+int packet_loop_timeout(struct packet_handle_ctx *ctx);
+
+// Forward between two {packet,N} streams with identical framing
+// without decoding frames.  Does not return.
+int packet_cut_through_ok(struct port *a, struct port *b);
+void packet_cut_through(struct packet_handle_ctx *ctx);
+
 
 // As an example, we provide a handler and instantiator that performs
 // simple forwarding between two packet ports.
@@ -45,8 +108,86 @@ void packet_forward(struct packet_handle_ctx *, int from, const uint8_t *buf, ss
 int packet_forward_main(int argc, char **argv);
 
 
+// Send one packet to a set of ports, e.g. for broadcast or flooding.
+// Stream ports that share a framing share a single encoded copy.
+struct packet_buf {
+    uint32_t refs;
+    uint32_t len;
+    uint8_t data[];
+};
+struct packet_buf *packet_buf_new(uint32_t size);
+struct packet_buf *packet_buf_ref(struct packet_buf *b);
+void packet_buf_unref(struct packet_buf *b);
+// Write an encoded packet.  Takes over the caller's reference.
+void port_write_encoded(struct port *p, struct packet_buf *b);
+void packet_fanout(struct packet_handle_ctx *, const int *to, int nb_to, const uint8_t *buf, ssize_t len);
+// Handler that sends to all ports except the source.
+void packet_flood(struct packet_handle_ctx *, int from, const uint8_t *buf, ssize_t len);
+
+// Hash of the flow a packet belongs to, for Ethernet frames, or for IP
+// packets if ip_only is set.
+uint32_t packet_flow_hash(const uint8_t *buf, ssize_t len, int ip_only);
+
+
+// IP routing between TUN ports, using longest prefix match on the
+// destination address.  Addresses are in network byte order, 4 bytes
+// for IPv4 or 16 bytes for IPv6.  route_lookup() returns the port or
+// -1.  packet_route() is a handler that expects ctx->priv to point to
+// the route table.
+struct route_table;
+struct route_table *route_table_new(void);
+void route_add(struct route_table *t, const uint8_t *addr, int addr_len, int plen, int port);
+int route_lookup(const struct route_table *t, const uint8_t *addr, int addr_len);
+int route_parse(struct route_table *t, const char *spec);
+void packet_route(struct packet_handle_ctx *, int from, const uint8_t *buf, ssize_t len);
+int packet_route_main(int argc, char **argv);
+
+
 // FIXME: Don't make buffers static size.
 #define PACKET_MAX_SIZE 4096
 
 
+// Stream ports keep a buffer of raw input in buf[head..count).  The
+// port's pop method decodes a frame from the front of the buffer and
+// returns its size, or returns 0 when no complete frame is available.
+// Empty frames are skipped.  New input is appended at the pointer
+// returned by buf_port_reserve().
+struct buf_port {
+    struct port p;
+    uint32_t flags;
+    uint32_t writes;     // since last flush
+    uint32_t outq_max;   // tty output queue limit, 0 for none
+    uint32_t baud;
+    uint8_t *hold;       // output held while the queue is above outq_max
+    uint32_t nb_hold;
+    uint32_t head;
+    uint32_t count;
+    uint8_t buf[2*PACKET_MAX_SIZE];
+};
+// Append a CRC-32C to each frame and drop frames that do not check
+// out.  Supported by SLIP and {packet,N} streams.  Set after opening.
+#define BUF_PORT_CRC32C 1
+// Batch writes within a loop step using TCP_CORK.  Set for TCP ports.
+// Writes outside a step are not batched.
+#define BUF_PORT_CORK 2
+
+uint8_t *buf_port_reserve(struct buf_port *p, uint32_t *room);
+
+// Stream encoders, exposed for testing and benchmarking.  The output
+// buffer needs to be at least *_ENCODE_MAX(len) bytes.  Return value
+// is the encoded size.
+#define SLIP_ENCODE_MAX(len) (2*((len)+4)+2)
+#define HEX_ENCODE_MAX(len) (3*(len)+1)
+#define PORT_ENCODE_MAX(len) HEX_ENCODE_MAX((len)+4)
+ssize_t slip_encode(uint8_t *out, const uint8_t *buf, ssize_t len);
+ssize_t slip_encode_crc(uint8_t *out, const uint8_t *buf, ssize_t len);
+ssize_t hex_encode(uint8_t *out, const uint8_t *buf, ssize_t len);
+uint32_t packetn_packet_write_size(uint32_t len_bytes, uint32_t size, uint8_t *buf);
+
+// CRC-32C, with crc = 0 for a new checksum.  crc32c() picks the
+// fastest implementation available on the CPU.
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len);
+
+
 #endif
@@ -45,6 +45,23 @@ test() {
 	wait
 }
 
+# Same, but the hop between the two processes is shared memory
+test_shm() {
+	killall packet_bridge.elf
+
+	($ELF TAP:tap0 SHM:test) &
+	sleep .1
+	($ELF SHM:test TAP:tap1) &
+	sleep .1
+
+	ifconfig tap0 up
+	brctl addif br0 tap0
+
+	ifconfig tap1 up
+
+	wait
+}
+
 $1
 
 
@@ -0,0 +1,5 @@
+// IP router between TUN (or other L3) ports.  See packet_route_main().
+#include "packet_bridge.h"
+int main(int argc, char **argv) {
+    return packet_route_main(argc, argv);
+}
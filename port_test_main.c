@@ -0,0 +1,504 @@
+// Port and packet loop test and benchmark.
+//
+//   port_test.elf test [seed]
+//   port_test.elf bench
+//
+// Covers fan-out, loop stepping, routing, bonded UDP over loopback,
+// TCP write batching, tty output holding and the shared memory port.
+// Stream codecs are tested in codec_test_main.c.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "codec_test.h"
+#include "macros.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+
+/***** Test */
+
+/* Fan-out needs to produce the same bytes as writing to each port
+ * separately.  Ports write into pipes. */
+static void test_fanout(uint64_t seed) {
+    struct port *(*open[])(int) = {
+        slip_fd_open, slip_crc_fd_open, packet2_fd_open, packet2_crc_fd_open,
+        hex_fd_open, slip_fd_open, packet2_fd_open, slip_crc_fd_open,
+    };
+    enum { nb = sizeof(open)/sizeof(open[0]) };
+    struct port *port[nb];
+    int to[nb], fd[nb];
+    for (int i=0; i<nb; i++) {
+        int pipefd[2];
+        CHECK(0 == pipe(pipefd));
+        port[i] = open[i](pipefd[1]);
+        fd[i] = pipefd[0];
+        to[i] = i;
+    }
+    struct packet_handle_ctx ctx = { .nb_ports = nb, .port = port };
+    uint8_t payload[1500];
+    fill_payload(&seed, payload, sizeof(payload));
+    packet_fanout(&ctx, to, nb, payload, sizeof(payload));
+    for (int i=0; i<nb; i++) {
+        uint8_t expect[PORT_ENCODE_MAX(sizeof(payload))];
+        uint8_t got[sizeof(expect) + 1];
+        ssize_t n = port[i]->encode(port[i], expect, payload, sizeof(payload));
+        CHECK(n == read(fd[i], got, sizeof(got)));
+        CHECK(!memcmp(expect, got, n));
+        close(fd[i]);
+        close(port[i]->fd_out);
+        free(port[i]);
+    }
+
+    /* Datagram ports are smaller than buffered ports, so framing
+     * checks must not look at their flags.  Run under ASan to see. */
+    struct port *a = packet2_fd_open(-1), *b = packet2_fd_open(-1);
+    struct port *dgram;
+    CHECK(dgram = calloc(1, sizeof(*dgram)));  // e.g. TAP
+    CHECK(packet_cut_through_ok(a, b));
+    CHECK(!packet_cut_through_ok(a, dgram));
+    CHECK(!packet_cut_through_ok(dgram, dgram));
+    free(a); free(b); free(dgram);
+}
+
+/* Packets left over when the budget runs out are picked up by the
+ * next step, which should be scheduled right away. */
+static void count_handler(struct packet_handle_ctx *ctx, int from, const uint8_t *buf, ssize_t len) {
+    CHECK(from == 0 && len == 100);
+}
+static void test_step(void) {
+    int pipefd[2];
+    CHECK(0 == pipe(pipefd));
+    struct port *port[1] = { port_open_packetn_stream(2, pipefd[0], -1) };
+    struct packet_handle_ctx ctx = { .nb_ports = 1, .port = port, .timeout = 1234 };
+    uint8_t enc[10 * 102], payload[100] = {};
+    for (int i=0; i<10; i++) {
+        port[0]->encode(port[0], &enc[i * 102], payload, sizeof(payload));
+    }
+    CHECK(sizeof(enc) == write(pipefd[1], enc, sizeof(enc)));
+    struct pollfd pfd[1];
+    packet_loop_pollfds(&ctx, pfd);
+    CHECK(pfd[0].fd == pipefd[0]);
+    CHECK(1 == poll(pfd, 1, 0));
+    CHECK(3 == packet_loop_step(count_handler, &ctx, pfd, 3));
+    CHECK(0 == packet_loop_timeout(&ctx));
+    pfd[0].revents = 0;
+    CHECK(3 == packet_loop_step(count_handler, &ctx, pfd, 3));
+    CHECK(4 == packet_loop_step(count_handler, &ctx, NULL, 0));
+    CHECK(1234 == packet_loop_timeout(&ctx));
+    CHECK(0 == packet_loop_step(count_handler, &ctx, NULL, 0));
+
+    /* Budget runs out on the last buffered frame.  The pipe blocks,
+     * so a step that reads would hang. */
+    CHECK(6 * 102 == write(pipefd[1], enc, 6 * 102));
+    CHECK(1 == poll(pfd, 1, 0));
+    CHECK(3 == packet_loop_step(count_handler, &ctx, pfd, 3));
+    pfd[0].revents = 0;
+    CHECK(3 == packet_loop_step(count_handler, &ctx, pfd, 3));
+    CHECK(0 == packet_loop_step(count_handler, &ctx, pfd, 3));
+    CHECK(1234 == packet_loop_timeout(&ctx));
+    close(pipefd[0]);
+    close(pipefd[1]);
+    free(port[0]);
+}
+
+/* Longest prefix match against a linear scan over the routes. */
+#define TEST_ROUTES 200
+struct test_route {
+    uint8_t addr[16];
+    int plen;
+    int port;
+};
+static int prefix_match(const uint8_t *a, const uint8_t *b, int plen) {
+    for (int i=0; i<plen; i++) {
+        int mask = 0x80 >> (i % 8);
+        if ((a[i/8] ^ b[i/8]) & mask) return 0;
+    }
+    return 1;
+}
+static int ref_route_lookup(const struct test_route *r, int nb, const uint8_t *addr) {
+    int best = -1, port = -1;
+    for (int i=0; i<nb; i++) {
+        /* Later routes replace earlier ones with the same prefix. */
+        if (r[i].plen >= best && prefix_match(r[i].addr, addr, r[i].plen)) {
+            best = r[i].plen;
+            port = r[i].port;
+        }
+    }
+    return port;
+}
+static void test_route(uint64_t seed, int addr_len) {
+    struct route_table *t = route_table_new();
+    struct test_route r[TEST_ROUTES];
+    for (int i=0; i<TEST_ROUTES; i++) {
+        /* Cluster routes so prefixes nest and overlap. */
+        fill_payload(&seed, r[i].addr, addr_len);
+        r[i].addr[0] &= 0x3;
+        r[i].plen = prng_next(&seed) % (8 * addr_len + 1);
+        r[i].port = prng_next(&seed) % 100;
+        route_add(t, r[i].addr, addr_len, r[i].plen, r[i].port);
+    }
+    for (int i=0; i<10000; i++) {
+        uint8_t addr[16];
+        fill_payload(&seed, addr, addr_len);
+        addr[0] &= 0x3;
+        /* Also probe near the routes themselves. */
+        if (i & 1) {
+            memcpy(addr, r[prng_next(&seed) % TEST_ROUTES].addr, addr_len);
+            addr[prng_next(&seed) % addr_len] ^= 1 << (prng_next(&seed) % 8);
+        }
+        CHECK(ref_route_lookup(r, TEST_ROUTES, addr) == route_lookup(t, addr, addr_len));
+    }
+
+    CHECK(route_parse(t, "10.1.0.0/16=7"));
+    CHECK(route_parse(t, "fd00::/8=8"));
+    CHECK(!route_parse(t, "TCP:host:1234:lowat=16384"));
+    CHECK(!route_parse(t, "TTY:slip:/dev/ttyUSB0:outq=fifo"));
+    CHECK(7 == route_lookup(t, (const uint8_t[]){10,1,2,3}, 4));
+    CHECK(8 == route_lookup(t, (const uint8_t[]){0xfd,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1}, 16));
+}
+
+/* Bonded UDP over loopback.  Packets with hand made sequence
+ * numbers are sent to a round robin bond, which needs to put them
+ * back in order, and give up on gaps that don't fit the window or
+ * that are not filled in time.  The peer is a plain socket on a port
+ * picked by the kernel. */
+struct test_bond {
+    int nb;
+    uint8_t id[16];
+};
+static void bond_handler(struct packet_handle_ctx *ctx, int from, const uint8_t *buf, ssize_t len) {
+    struct test_bond *t = ctx->priv;
+    CHECK(t->nb < 16);
+    CHECK(len == 1 || len == PACKET_MAX_SIZE);
+    for (ssize_t i=1; i<len; i++) CHECK(buf[i] == buf[0]);
+    t->id[t->nb++] = buf[0];
+}
+static void bond_send(int fd, struct sockaddr_in *to, uint8_t seq, ssize_t len) {
+    uint8_t pkt[PACKET_MAX_SIZE + 4];
+    memset(pkt, seq, len);
+    memcpy(&pkt[len], (uint8_t[]){ 0, 0, 0, seq }, 4);
+    CHECK(len + 4 == sendto(fd, pkt, len + 4, 0, (struct sockaddr *)to, sizeof(*to)));
+}
+static void test_bond(void) {
+    int fd;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addrlen = sizeof(addr);
+    CHECK(-1 != (fd = socket(AF_INET, SOCK_DGRAM, 0)));
+    CHECK(0 == bind(fd, (struct sockaddr *)&addr, sizeof(addr)));
+    CHECK(0 == getsockname(fd, (struct sockaddr *)&addr, &addrlen));
+
+    /* The first path can't send to a broadcast address, so the bond
+     * needs to fall over to the second one.  Only the second path
+     * receives, since the order in which different sockets are
+     * serviced is not defined.  It is bound to another loopback
+     * address, as it would be to an uplink's. */
+    char spec[64];
+    snprintf(spec, sizeof(spec), "BOND-RR:255.255.255.255:9,127.0.0.1:%d@127.0.0.2", ntohs(addr.sin_port));
+    struct port *port[1] = { port_open(spec) };
+    uint8_t buf[PACKET_MAX_SIZE + 4];
+    struct sockaddr_in bond_addr;
+    for (int i=0; i<3; i++) {
+        CHECK(1 + 4 == port[0]->write(port[0], (uint8_t[]){ 0x55 }, 1));
+        addrlen = sizeof(bond_addr);
+        CHECK(1 + 4 == recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&bond_addr, &addrlen));
+        CHECK(bond_addr.sin_addr.s_addr == htonl(0x7F000002));
+    }
+
+    struct test_bond t = {};
+    struct packet_handle_ctx ctx = { .nb_ports = 1, .port = port, .priv = &t, .timeout = -1 };
+    const uint8_t seq[] = { 0, 2, 1, 3, 5, 4, 7, 20, 21 };
+    const uint8_t expect[] = { 0, 1, 2, 3, 4, 5, 7, 20, 21 };
+    for (int i=0; i<sizeof(seq); i++) bond_send(fd, &bond_addr, seq[i], 1);
+    struct pollfd pfd[1];
+    packet_loop_pollfds(&ctx, pfd);
+    while (t.nb < sizeof(expect)) {
+        CHECK(1 == poll(pfd, 1, 1000));
+        packet_loop_step(bond_handler, &ctx, pfd, 0);
+    }
+    CHECK(!memcmp(t.id, expect, sizeof(expect)));
+
+    /* 22 is lost.  23 is held until the deadline, which the loop
+     * timeout reports.  Full size frames keep their payload. */
+    bond_send(fd, &bond_addr, 23, PACKET_MAX_SIZE);
+    bond_send(fd, &bond_addr, 24, 1);
+    int held = 0;
+    for (int n=0; t.nb < sizeof(expect) + 2; n++) {
+        CHECK(n < 100);
+        int timeout = packet_loop_timeout(&ctx);
+        if (timeout >= 0) {
+            CHECK(timeout <= 5);
+            held = 1;
+        }
+        CHECK(-1 != poll(pfd, 1, timeout < 0 ? 100 : timeout));
+        packet_loop_step(bond_handler, &ctx, pfd, 0);
+    }
+    CHECK(held);
+    CHECK(t.id[sizeof(expect)] == 23 && t.id[sizeof(expect) + 1] == 24);
+    CHECK(-1 == packet_loop_timeout(&ctx));
+    close(fd);
+
+    /* Flow hash: same flow, same hash, for Ethernet and IP. */
+    uint8_t ip[40] = { 0x45, [9] = 17, [12] = 10, 0, 0, 1, 10, 0, 0, 2, 0x12, 0x34, 0x56, 0x78 };
+    uint8_t eth[54] = { [12] = 0x08, 0x00 };
+    memcpy(&eth[14], ip, sizeof(ip));
+    CHECK(packet_flow_hash(ip, sizeof(ip), 1) == packet_flow_hash(eth, sizeof(eth), 0));
+    ip[21]++;
+    CHECK(packet_flow_hash(ip, sizeof(ip), 1) != packet_flow_hash(eth, sizeof(eth), 0));
+
+    /* IP from a TUN port, with a source address that looks like an
+     * Ethernet type: TCP segments of one flow need the same hash. */
+    uint8_t tcp[2][40] = {
+        { 0x45, [9] = 6, [12] = 8, 0, 69, 1, 10, 0, 0, 2, 0x12, 0x34, 0x56, 0x78, 0, 0, 0, 1 },
+        { 0x45, [9] = 6, [12] = 8, 0, 69, 1, 10, 0, 0, 2, 0x12, 0x34, 0x56, 0x78, 0, 0, 5, 0xb5 },
+    };
+    CHECK(packet_flow_hash(tcp[0], 40, 1) == packet_flow_hash(tcp[1], 40, 1));
+}
+
+/* TCP ports are corked from the second write of a loop step until
+ * the end of the step.  Writes from outside a step have no flush to
+ * follow them, so they must not cork the socket.  The connection is
+ * never accepted, which doesn't matter for a few small writes. */
+static int tcp_corked(struct port *p) {
+    int cork;
+    socklen_t len = sizeof(cork);
+    CHECK(0 == getsockopt(p->fd_out, IPPROTO_TCP, TCP_CORK, &cork, &len));
+    return cork;
+}
+static void tcp_handler(struct packet_handle_ctx *ctx, int from, const uint8_t *buf, ssize_t len) {
+    struct port *tcp = ctx->port[1];
+    CHECK(len + 4 == tcp->write(tcp, buf, len));
+    CHECK(!tcp_corked(tcp));
+    CHECK(len + 4 == tcp->write(tcp, buf, len));
+    CHECK(tcp_corked(tcp));
+}
+static void test_tcp(void) {
+    int lfd;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addrlen = sizeof(addr);
+    CHECK(-1 != (lfd = socket(AF_INET, SOCK_STREAM, 0)));
+    CHECK(0 == bind(lfd, (struct sockaddr *)&addr, sizeof(addr)));
+    CHECK(0 == listen(lfd, 1));
+    CHECK(0 == getsockname(lfd, (struct sockaddr *)&addr, &addrlen));
+
+    int pipefd[2];
+    CHECK(0 == pipe(pipefd));
+    struct port *port[2] = {
+        port_open_packetn_stream(4, pipefd[0], -1),
+        port_open_tcp("127.0.0.1", ntohs(addr.sin_port), "4", NULL),
+    };
+    uint8_t payload[10] = {};
+    for (int i=0; i<3; i++) {
+        CHECK(4 + sizeof(payload) == port[1]->write(port[1], payload, sizeof(payload)));
+        CHECK(!tcp_corked(port[1]));
+    }
+
+    struct packet_handle_ctx ctx = { .nb_ports = 2, .port = port, .timeout = -1 };
+    uint8_t enc[4 + sizeof(payload)];
+    port[0]->encode(port[0], enc, payload, sizeof(payload));
+    CHECK(sizeof(enc) == write(pipefd[1], enc, sizeof(enc)));
+    CHECK(1 == packet_loop_step(tcp_handler, &ctx, NULL, 0));
+    CHECK(!tcp_corked(port[1]));
+    CHECK(4 + sizeof(payload) == port[1]->write(port[1], payload, sizeof(payload)));
+    CHECK(!tcp_corked(port[1]));
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(port[1]->fd);
+    close(lfd);
+    free(port[0]);
+    free(port[1]);
+}
+
+/* A port with an output queue limit holds frames instead of waiting
+ * for the queue to drain, and writes them from the step that its
+ * timeout asks for.  A socket stands in for the tty, since SIOCOUTQ
+ * is TIOCOUTQ. */
+static void outq_handler(struct packet_handle_ctx *ctx, int from, const uint8_t *buf, ssize_t len) {
+    CHECK(0);
+}
+static void test_outq(void) {
+    int sv[2];
+    CHECK(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    struct port *port[1] = { port_open_packetn_stream(2, sv[0], sv[0]) };
+    port_set_outq(port[0], 1, 9600);
+    struct buf_port *b = (struct buf_port *)port[0];
+    struct packet_handle_ctx ctx = { .nb_ports = 1, .port = port, .timeout = -1 };
+    CHECK(-1 == packet_loop_timeout(&ctx));
+
+    uint8_t payload[10] = {}, buf[64];
+    CHECK(12 == port[0]->write(port[0], payload, sizeof(payload)));
+    CHECK(0 == b->nb_hold);
+    CHECK(12 == port[0]->write(port[0], payload, sizeof(payload)));
+    CHECK(12 == b->nb_hold);
+    CHECK(0 < packet_loop_timeout(&ctx));
+
+    CHECK(12 == recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT));
+    CHECK(0 == packet_loop_timeout(&ctx));
+    CHECK(0 == packet_loop_step(outq_handler, &ctx, NULL, 0));
+    CHECK(0 == b->nb_hold);
+    CHECK(-1 == packet_loop_timeout(&ctx));
+    CHECK(12 == recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT));
+
+    close(sv[0]);
+    close(sv[1]);
+    free(b->hold);
+    free(port[0]);
+}
+
+/* Two processes, one echoes what the other sends.  Batches stay
+ * below the ring size, so nothing is dropped. */
+#define TEST_SHM_BATCH 32
+#define TEST_SHM_ROUNDS 16
+static ssize_t shm_frame(uint64_t *s, uint8_t *buf) {
+    ssize_t len = 1 + prng_next(s) % PACKET_MAX_SIZE;
+    for (ssize_t i=0; i<len; i++) buf[i] = prng_next(s);
+    return len;
+}
+struct test_shm {
+    int nb;
+    uint64_t seed;
+};
+static void shm_echo(struct packet_handle_ctx *ctx, int from, const uint8_t *buf, ssize_t len) {
+    struct test_shm *t = ctx->priv;
+    CHECK(len == ctx->port[0]->write(ctx->port[0], (uint8_t*)buf, len));
+    t->nb++;
+}
+static void shm_check(struct packet_handle_ctx *ctx, int from, const uint8_t *buf, ssize_t len) {
+    struct test_shm *t = ctx->priv;
+    uint8_t expect[PACKET_MAX_SIZE];
+    CHECK(len == shm_frame(&t->seed, expect));
+    CHECK(!memcmp(buf, expect, len));
+    t->nb++;
+}
+static void test_shm(uint64_t seed) {
+    char name[32];
+    snprintf(name, sizeof(name), "codec_test-%d", (int)getpid());
+    pid_t pid = fork();
+    CHECK(pid != -1);
+    struct port *port[1] = { port_open_shm(name) };
+    struct test_shm t = { .seed = seed };
+    struct packet_handle_ctx ctx = { .nb_ports = 1, .port = port, .priv = &t };
+    struct pollfd pfd[1];
+    packet_loop_pollfds(&ctx, pfd);
+    if (!pid) {
+        while (t.nb < TEST_SHM_BATCH * TEST_SHM_ROUNDS) {
+            CHECK(1 == poll(pfd, 1, 1000));
+            packet_loop_step(shm_echo, &ctx, pfd, 0);
+        }
+        _exit(0);
+    }
+    uint64_t tx_seed = seed;
+    for (int r=0; r<TEST_SHM_ROUNDS; r++) {
+        for (int i=0; i<TEST_SHM_BATCH; i++) {
+            uint8_t buf[PACKET_MAX_SIZE];
+            ssize_t len = shm_frame(&tx_seed, buf);
+            CHECK(len == port[0]->write(port[0], buf, len));
+        }
+        while (t.nb < (r + 1) * TEST_SHM_BATCH) {
+            CHECK(1 == poll(pfd, 1, 1000));
+            packet_loop_step(shm_check, &ctx, pfd, 0);
+        }
+    }
+    int status;
+    CHECK(pid == waitpid(pid, &status, 0));
+    CHECK(WIFEXITED(status) && !WEXITSTATUS(status));
+}
+
+static int test(uint64_t seed) {
+    test_fanout(seed);
+    test_step();
+    test_route(seed, 4);
+    test_route(seed, 16);
+    test_bond();
+    test_tcp();
+    test_outq();
+    test_shm(seed);
+    LOG("port_test: OK\n");
+    return 0;
+}
+
+
+/***** Benchmark */
+
+/* Fan-out to many SLIP ports vs. writing to each one.  Output goes
+ * to /dev/null, so this mostly measures encoding. */
+#define BENCH_FANOUT 50
+static void bench_fanout(void) {
+    int null_fd;
+    ASSERT_ERRNO(null_fd = open("/dev/null", O_WRONLY));
+    struct port *port[BENCH_FANOUT];
+    int to[BENCH_FANOUT];
+    for (int i=0; i<BENCH_FANOUT; i++) {
+        port[i] = slip_fd_open(null_fd);
+        to[i] = i;
+    }
+    struct packet_handle_ctx ctx = { .nb_ports = BENCH_FANOUT, .port = port };
+    uint8_t payload[1500];
+    uint64_t s = 1;
+    fill_payload(&s, payload, sizeof(payload));
+    for (int fanout=0; fanout<2; fanout++) {
+        int64_t frames = 0, t0 = now_ns(), t1;
+        do {
+            if (fanout) {
+                packet_fanout(&ctx, to, BENCH_FANOUT, payload, sizeof(payload));
+            }
+            else {
+                for (int i=0; i<BENCH_FANOUT; i++) {
+                    port[i]->write(port[i], payload, sizeof(payload));
+                }
+            }
+            frames++;
+        } while ((t1 = now_ns()) - t0 < BENCH_NS);
+        report("slip x50", fanout ? "fan" : "each", "1500", t1 - t0, frames, frames * sizeof(payload));
+    }
+    for (int i=0; i<BENCH_FANOUT; i++) free(port[i]);
+    close(null_fd);
+}
+
+/* Route lookups in a table with a mix of prefix lengths. */
+static void bench_route(int addr_len) {
+    struct route_table *t = route_table_new();
+    uint64_t s = 1;
+    for (int i=0; i<10000; i++) {
+        uint8_t addr[16];
+        fill_payload(&s, addr, addr_len);
+        route_add(t, addr, addr_len, 8 + prng_next(&s) % (8 * addr_len - 7), i % 100);
+    }
+    enum { nb = 4096 };
+    static uint8_t addr[nb][16];
+    for (int i=0; i<nb; i++) fill_payload(&s, addr[i], addr_len);
+    int64_t lookups = 0, t0 = now_ns(), t1;
+    int sum = 0;
+    do {
+        for (int i=0; i<nb; i++) sum += route_lookup(t, addr[i], addr_len);
+        lookups += nb;
+    } while ((t1 = now_ns()) - t0 < BENCH_NS);
+    bench_sink = sum;
+    report(addr_len == 4 ? "route4" : "route6", "", "10k", t1 - t0, lookups, lookups * addr_len);
+}
+
+static int bench(void) {
+    bench_route(4);
+    bench_route(16);
+    bench_fanout();
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    const char *cmd = argc > 1 ? argv[1] : "test";
+    if (!strcmp(cmd, "test")) {
+        uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x123456789ULL;
+        return test(seed);
+    }
+    if (!strcmp(cmd, "bench")) {
+        return bench();
+    }
+    ERROR("usage: %s test [seed] | bench\n", argv[0]);
+}